@@ -6,6 +6,37 @@
 #include <gtk/gtk.h>
 #include <algorithm>
 #include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <filesystem>
+#include <queue>
+#include <map>
+#include <limits>
+#include <cmath>
+#include <condition_variable>
+#include <cerrno>
+#include <glib-unix.h>
+#include <csignal>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <charconv>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -26,38 +57,372 @@ struct Node {
     Node(WordFreq d) : data(d), next(nullptr) {}
 };
 
+// Instrumented phases of the classify/feedback path
+enum MetricPhase {
+    PHASE_TOKENIZE,
+    PHASE_LOOKUP,
+    PHASE_SCORE,
+    PHASE_HIGHLIGHT,
+    PHASE_FEEDBACK,
+    PHASE_SAVE,
+    PHASE_PREPROCESS,
+    PHASE_COUNT
+};
+
+const char* phaseName(int phase) {
+    static const char* names[PHASE_COUNT] = {"tokenize", "lookup", "score", "highlight", "feedback_update", "save", "preprocess"};
+    return names[phase];
+}
+
+// Lock-free latency histogram with power-of-two buckets from 1us to ~8s
+struct LatencyHistogram {
+    static const int BUCKETS = 24;
+    atomic<uint64_t> buckets[BUCKETS + 1] = {}; // last bucket is +Inf
+    atomic<uint64_t> count{0};
+    atomic<uint64_t> sumNanos{0};
+
+    static uint64_t upperBoundNanos(int bucket) { return 1000ull << bucket; }
+
+    void record(uint64_t nanos) {
+        int bucket = 0;
+        while (bucket < BUCKETS && nanos > upperBoundNanos(bucket)) bucket++;
+        buckets[bucket].fetch_add(1, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+        sumNanos.fetch_add(nanos, memory_order_relaxed);
+    }
+
+    // Upper bound of the bucket holding the q-th quantile, in nanoseconds
+    uint64_t quantileNanos(double q) const {
+        uint64_t total = count.load(memory_order_relaxed);
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(q * total), seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += buckets[i].load(memory_order_relaxed);
+            if (seen > rank) return upperBoundNanos(i);
+        }
+        return upperBoundNanos(BUCKETS - 1) * 2;
+    }
+};
+
+// Lookup counters for one named hash map
+struct MapCounters {
+    atomic<uint64_t> lookups{0};
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+    atomic<uint64_t> probes{0};
+    atomic<uint64_t> maxProbe{0};
+
+    void recordLookup(bool hit, uint64_t probeLength) {
+        lookups.fetch_add(1, memory_order_relaxed);
+        (hit ? hits : misses).fetch_add(1, memory_order_relaxed);
+        probes.fetch_add(probeLength, memory_order_relaxed);
+        uint64_t current = maxProbe.load(memory_order_relaxed);
+        while (probeLength > current && !maxProbe.compare_exchange_weak(current, probeLength, memory_order_relaxed)) {}
+    }
+};
+
+// Process-wide metrics registry
+class Metrics {
+private:
+    LatencyHistogram phases[PHASE_COUNT];
+    mutex mapsMutex;
+    deque<pair<string, MapCounters>> maps;
+
+public:
+    void recordPhase(MetricPhase phase, uint64_t nanos) { phases[phase].record(nanos); }
+    const LatencyHistogram& phase(int p) const { return phases[p]; }
+
+    MapCounters* mapCounters(const string& name) {
+        lock_guard<mutex> lock(mapsMutex);
+        for (auto& entry : maps)
+            if (entry.first == name) return &entry.second;
+        maps.emplace_back(piecewise_construct, forward_as_tuple(name), forward_as_tuple());
+        return &maps.back().second;
+    }
+
+    // Prometheus text exposition format
+    string renderPrometheus() {
+        stringstream out;
+        out << "# HELP spam_phase_duration_seconds Latency of classifier phases.\n"
+            << "# TYPE spam_phase_duration_seconds histogram\n";
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            const LatencyHistogram& h = phases[p];
+            uint64_t cumulative = 0;
+            for (int i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+                cumulative += h.buckets[i].load(memory_order_relaxed);
+                out << "spam_phase_duration_seconds_bucket{phase=\"" << phaseName(p) << "\",le=\""
+                    << LatencyHistogram::upperBoundNanos(i) / 1e9 << "\"} " << cumulative << "\n";
+            }
+            cumulative += h.buckets[LatencyHistogram::BUCKETS].load(memory_order_relaxed);
+            out << "spam_phase_duration_seconds_bucket{phase=\"" << phaseName(p) << "\",le=\"+Inf\"} " << cumulative << "\n"
+                << "spam_phase_duration_seconds_sum{phase=\"" << phaseName(p) << "\"} "
+                << h.sumNanos.load(memory_order_relaxed) / 1e9 << "\n"
+                << "spam_phase_duration_seconds_count{phase=\"" << phaseName(p) << "\"} "
+                << h.count.load(memory_order_relaxed) << "\n";
+        }
+
+        lock_guard<mutex> lock(mapsMutex);
+        const char* counterNames[] = {"lookups", "hits", "misses", "probes"};
+        for (int c = 0; c < 4; ++c) {
+            out << "# TYPE spam_map_" << counterNames[c] << "_total counter\n";
+            for (auto& entry : maps) {
+                const MapCounters& mc = entry.second;
+                const atomic<uint64_t>* values[] = {&mc.lookups, &mc.hits, &mc.misses, &mc.probes};
+                out << "spam_map_" << counterNames[c] << "_total{map=\"" << entry.first << "\"} "
+                    << values[c]->load(memory_order_relaxed) << "\n";
+            }
+        }
+        out << "# TYPE spam_map_max_probe_length gauge\n";
+        for (auto& entry : maps)
+            out << "spam_map_max_probe_length{map=\"" << entry.first << "\"} "
+                << entry.second.maxProbe.load(memory_order_relaxed) << "\n";
+        return out.str();
+    }
+
+    // Human-readable summary for the Metrics dialog
+    string renderSummary() {
+        stringstream out;
+        out << fixed << setprecision(1)
+            << left << setw(18) << "phase" << right << setw(10) << "count"
+            << setw(12) << "avg us" << setw(12) << "p50 us" << setw(12) << "p99 us" << "\n";
+        for (int p = 0; p < PHASE_COUNT; ++p) {
+            const LatencyHistogram& h = phases[p];
+            uint64_t n = h.count.load(memory_order_relaxed);
+            double avg = n ? h.sumNanos.load(memory_order_relaxed) / 1e3 / n : 0.0;
+            out << left << setw(18) << phaseName(p) << right << setw(10) << n << setw(12) << avg
+                << setw(12) << h.quantileNanos(0.50) / 1e3 << setw(12) << h.quantileNanos(0.99) / 1e3 << "\n";
+        }
+
+        out << "\n" << left << setw(18) << "map" << right << setw(10) << "lookups" << setw(12) << "hits"
+            << setw(12) << "misses" << setw(12) << "avg probe" << setw(12) << "max probe" << "\n";
+        lock_guard<mutex> lock(mapsMutex);
+        for (auto& entry : maps) {
+            const MapCounters& mc = entry.second;
+            uint64_t n = mc.lookups.load(memory_order_relaxed);
+            out << left << setw(18) << entry.first << right << setw(10) << n
+                << setw(12) << mc.hits.load(memory_order_relaxed) << setw(12) << mc.misses.load(memory_order_relaxed)
+                << setw(12) << (n ? (double)mc.probes.load(memory_order_relaxed) / n : 0.0)
+                << setw(12) << mc.maxProbe.load(memory_order_relaxed) << "\n";
+        }
+        return out.str();
+    }
+
+    // Write the Prometheus dump atomically so scrapers never see a partial file
+    bool writePrometheusFile(const string& filename) {
+        string tmpName = filename + ".tmp";
+        ofstream file(tmpName);
+        if (!file.is_open()) return false;
+        file << renderPrometheus();
+        file.close();
+        return file && rename(tmpName.c_str(), filename.c_str()) == 0;
+    }
+};
+
+Metrics& metrics() {
+    static Metrics instance;
+    return instance;
+}
+
+// Records the lifetime of a scope into a phase histogram
+class PhaseTimer {
+private:
+    MetricPhase phase;
+    chrono::steady_clock::time_point start;
+
+public:
+    PhaseTimer(MetricPhase p) : phase(p), start(chrono::steady_clock::now()) {}
+    ~PhaseTimer() {
+        auto elapsed = chrono::steady_clock::now() - start;
+        metrics().recordPhase(phase, chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+// 64-bit word-at-a-time hash (wyhash final v4 construction)
+static inline uint64_t wyMix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wyRead8(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyRead4(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+uint64_t wyhash64(const void* key, size_t len, uint64_t seed = 0) {
+    static const uint64_t secret[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+                                       0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+    const uint8_t* p = static_cast<const uint8_t*>(key);
+    seed ^= wyMix(seed ^ secret[0], secret[1]);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyRead4(p) << 32) | wyRead4(p + ((len >> 3) << 2));
+            b = (wyRead4(p + len - 4) << 32) | wyRead4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wyMix(wyRead8(p) ^ secret[1], wyRead8(p + 8) ^ seed);
+                see1 = wyMix(wyRead8(p + 16) ^ secret[2], wyRead8(p + 24) ^ see1);
+                see2 = wyMix(wyRead8(p + 32) ^ secret[3], wyRead8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wyMix(wyRead8(p) ^ secret[1], wyRead8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = wyRead8(p + i - 16);
+        b = wyRead8(p + i - 8);
+    }
+
+    __uint128_t r = (__uint128_t)(a ^ secret[1]) * (b ^ seed);
+    return wyMix((uint64_t)r ^ secret[0] ^ len, (uint64_t)(r >> 64) ^ secret[1]);
+}
+
+// Hash functions selectable per map
+enum HashFunction {
+    HASH_WYHASH,    // 64-bit word-at-a-time hash (default)
+    HASH_LEGACY_37  // original byte-at-a-time 37 * h + c, kept for comparison
+};
+
+const char* hashFunctionName(HashFunction hf) {
+    return hf == HASH_LEGACY_37 ? "legacy-37" : "wyhash";
+}
+
+// Bucket distribution diagnostics for a loaded map
+struct HashMapStats {
+    size_t buckets = 0;
+    size_t entries = 0;
+    size_t occupiedBuckets = 0;
+    size_t collisions = 0;      // entries not stored at their home bucket / chain head
+    size_t maxChainLength = 0;  // chaining only
+    size_t maxProbeLength = 0;  // open addressing only, in slots inspected by a successful search
+    double avgProbeLength = 0.0;
+};
+
+// Read-only view of word counts that the classifier scores against
+class WordLookup {
+public:
+    virtual ~WordLookup() {}
+
+    virtual bool lookupCounts(const string& word, double& spamFreq, double& hamFreq) = 0;
+
+    // Spam share of a word; false when the word is unknown or has no counts
+    virtual bool lookupSpamProbability(const string& word, double& probability) {
+        double spamFreq, hamFreq;
+        if (!lookupCounts(word, spamFreq, hamFreq) || spamFreq + hamFreq <= 0) return false;
+        probability = spamFreq / (spamFreq + hamFreq);
+        return true;
+    }
+};
+
 // Abstract HashMap class
-class HashMap {
+class HashMap : public WordLookup {
 protected:
     int size;
     int count;
+    HashFunction hashFunction;
+    MapCounters* counters = nullptr;
+
+    uint64_t hashKey(const string& key) const {
+        if (hashFunction == HASH_LEGACY_37) {
+            uint32_t hashVal = 0;
+            for (char c : key)
+                hashVal = 37 * hashVal + (unsigned char)c;
+            return hashVal;
+        }
+        return wyhash64(key.data(), key.size());
+    }
+
+    size_t hash(const string& key) const {
+        return hashKey(key) % size;
+    }
+
+    void recordLookup(bool hit, uint64_t probeLength) {
+        if (counters) counters->recordLookup(hit, probeLength);
+    }
 
-    int hash(string key) {
-        int hashVal = 0;
-        for (char c : key)
-            hashVal = 37 * hashVal + c;
-        return abs(hashVal) % size;
+    // Heap bytes of a key beyond the inline small-string buffer
+    static size_t keyHeapBytes(const string& key) {
+        return key.capacity() > 15 ? key.capacity() + 1 : 0;
     }
 
 public:
-    HashMap(int s = 10007) : size(s), count(0) {}
+    HashMap(int s = 10007, HashFunction hf = HASH_WYHASH) : size(s), count(0), hashFunction(hf) {}
     virtual ~HashMap() {}
 
     virtual void insert(WordFreq data) = 0;
-    virtual WordFreq* search(string key) = 0;
+    virtual WordFreq* search(const string& key) = 0;
     virtual void clear() = 0;
+    virtual bool erase(const string& key) = 0;
+    // Remove every entry matching pred in one linear pass; returns the number removed
+    virtual size_t eraseIf(const function<bool(const WordFreq&)>& pred) = 0;
+    virtual HashMapStats collectStats() const = 0;
+    virtual void forEach(const function<void(const WordFreq&)>& visit) const = 0;
+    // Approximate heap bytes held by the map (excludes allocator bookkeeping)
+    virtual size_t memoryUsage() const = 0;
+
+    bool lookupCounts(const string& word, double& spamFreq, double& hamFreq) override {
+        WordFreq* wf = search(word);
+        if (!wf) return false;
+        spamFreq = wf->spamFreq;
+        hamFreq = wf->hamFreq;
+        return true;
+    }
 
     double getLoadFactor() { return (double)count / size; }
     int getCount() { return count; }
+    HashFunction getHashFunction() const { return hashFunction; }
+
+    // Attach lookup counters reported under the given map name
+    void setMetricsName(const string& name) { counters = metrics().mapCounters(name); }
 };
 
 // Chaining HashMap implementation
 class ChainingHashMap : public HashMap {
 private:
     vector<Node*> table;
+    Node* freeNodes = nullptr; // erased nodes kept for reuse by insert
+    size_t freeCount = 0;
+
+    Node* allocateNode(const WordFreq& data) {
+        if (!freeNodes) return new Node(data);
+        Node* node = freeNodes;
+        freeNodes = node->next;
+        freeCount--;
+        node->data = data;
+        node->next = nullptr;
+        return node;
+    }
+
+    void releaseNode(Node* node) {
+        node->data = WordFreq();
+        node->next = freeNodes;
+        freeNodes = node;
+        freeCount++;
+    }
 
 public:
-    ChainingHashMap(int s = 10007) : HashMap(s) {
+    ChainingHashMap(int s = 10007, HashFunction hf = HASH_WYHASH) : HashMap(s, hf) {
         table.resize(size, nullptr);
     }
 
@@ -66,8 +431,8 @@ public:
     }
 
     void insert(WordFreq data) override {
-        int index = hash(data.word);
-        Node* newNode = new Node(data);
+        size_t index = hash(data.word);
+        Node* newNode = allocateNode(data);
 
         if (!table[index]) {
             table[index] = newNode;
@@ -79,7 +444,7 @@ public:
         while (current->next) {
             if (current->data.word == data.word) {
                 current->data = data;
-                delete newNode;
+                releaseNode(newNode);
                 return;
             }
             current = current->next;
@@ -87,7 +452,7 @@ public:
 
         if (current->data.word == data.word) {
             current->data = data;
-            delete newNode;
+            releaseNode(newNode);
             return;
         }
 
@@ -95,15 +460,20 @@ public:
         count++;
     }
 
-    WordFreq* search(string key) override {
-        int index = hash(key);
+    WordFreq* search(const string& key) override {
+        size_t index = hash(key);
         Node* current = table[index];
+        uint64_t probes = 0;
 
         while (current) {
-            if (current->data.word == key)
+            probes++;
+            if (current->data.word == key) {
+                recordLookup(true, probes);
                 return &(current->data);
+            }
             current = current->next;
         }
+        recordLookup(false, probes);
         return nullptr;
     }
 
@@ -115,9 +485,77 @@ public:
                 delete temp;
             }
         }
-        table.clear();
+        while (freeNodes) {
+            Node* temp = freeNodes;
+            freeNodes = freeNodes->next;
+            delete temp;
+        }
+        freeCount = 0;
+        table.assign(size, nullptr);
         count = 0;
     }
+
+    bool erase(const string& key) override {
+        for (Node** link = &table[hash(key)]; *link; link = &(*link)->next) {
+            if ((*link)->data.word == key) {
+                Node* node = *link;
+                *link = node->next;
+                releaseNode(node);
+                count--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t eraseIf(const function<bool(const WordFreq&)>& pred) override {
+        size_t removed = 0;
+        for (Node*& head : table) {
+            for (Node** link = &head; *link;) {
+                if (pred((*link)->data)) {
+                    Node* node = *link;
+                    *link = node->next;
+                    releaseNode(node);
+                    removed++;
+                } else {
+                    link = &(*link)->next;
+                }
+            }
+        }
+        count -= removed;
+        return removed;
+    }
+
+    void forEach(const function<void(const WordFreq&)>& visit) const override {
+        for (Node* head : table)
+            for (Node* n = head; n; n = n->next)
+                visit(n->data);
+    }
+
+    size_t memoryUsage() const override {
+        size_t bytes = table.capacity() * sizeof(Node*) + freeCount * sizeof(Node);
+        forEach([&](const WordFreq& wf) { bytes += sizeof(Node) + keyHeapBytes(wf.word); });
+        return bytes;
+    }
+
+    HashMapStats collectStats() const override {
+        HashMapStats stats;
+        stats.buckets = size;
+        stats.entries = count;
+        size_t probeTotal = 0;
+        for (Node* head : table) {
+            size_t chain = 0;
+            for (Node* n = head; n; n = n->next) {
+                chain++;
+                probeTotal += chain;
+            }
+            if (chain > 0) stats.occupiedBuckets++;
+            stats.maxChainLength = max(stats.maxChainLength, chain);
+        }
+        stats.collisions = stats.entries - stats.occupiedBuckets;
+        stats.avgProbeLength = count > 0 ? (double)probeTotal / count : 0.0;
+        return stats;
+    }
 };
 
 // Open Addressing HashMap implementation
@@ -125,17 +563,46 @@ class OpenAddressingHashMap : public HashMap {
 private:
     vector<pair<bool, WordFreq>> table;
 
+    // Backward-shift deletion: pull later members of the probe cluster into the
+    // hole so searches never need tombstones
+    void eraseSlot(size_t hole) {
+        table[hole] = {false, WordFreq()};
+        count--;
+        for (size_t j = (hole + 1) % size; table[j].first; j = (j + 1) % size) {
+            size_t home = hash(table[j].second.word);
+            if ((hole + size - home) % size < (j + size - home) % size) {
+                table[hole] = move(table[j]);
+                table[j] = {false, WordFreq()};
+                hole = j;
+            }
+        }
+    }
+
+    // Double the table before an insert would take it past 0.7 load, so any
+    // vocabulary size fits and probe sequences stay short
+    void growIfNeeded() {
+        if ((size_t)(count + 1) * 10 <= (size_t)size * 7) return;
+        vector<pair<bool, WordFreq>> old;
+        old.swap(table);
+        size = size * 2 + 1;
+        table.assign(size, {false, WordFreq()});
+        count = 0;
+        for (auto& slot : old)
+            if (slot.first) insert(move(slot.second));
+    }
+
 public:
-    OpenAddressingHashMap(int s = 10007) : HashMap(s) {
+    OpenAddressingHashMap(int s = 10007, HashFunction hf = HASH_WYHASH) : HashMap(s, hf) {
         table.resize(size, {false, WordFreq()});
     }
 
     void insert(WordFreq data) override {
-        int index = hash(data.word);
+        growIfNeeded();
+        size_t index = hash(data.word);
         int i = 0;
 
         while (i < size) {
-            int currentIndex = (index + i) % size;
+            size_t currentIndex = (index + i) % size;
 
             if (!table[currentIndex].first) {
                 table[currentIndex] = {true, data};
@@ -150,18 +617,24 @@ public:
         cout << "Hash table is full!" << endl;
     }
 
-    WordFreq* search(string key) override {
-        int index = hash(key);
+    WordFreq* search(const string& key) override {
+        size_t index = hash(key);
         int i = 0;
 
         while (i < size) {
-            int currentIndex = (index + i) % size;
+            size_t currentIndex = (index + i) % size;
 
-            if (!table[currentIndex].first) return nullptr;
-            if (table[currentIndex].second.word == key)
+            if (!table[currentIndex].first) {
+                recordLookup(false, i + 1);
+                return nullptr;
+            }
+            if (table[currentIndex].second.word == key) {
+                recordLookup(true, i + 1);
                 return &(table[currentIndex].second);
+            }
             i++;
         }
+        recordLookup(false, size);
         return nullptr;
     }
 
@@ -170,221 +643,2544 @@ public:
         table.resize(size, {false, WordFreq()});
         count = 0;
     }
-};
-
-// EmailClassifier with probability
-class EmailClassifier {
-private:
-    HashMap* wordMap;
-    double threshold;
 
-public:
-    EmailClassifier(HashMap* map, double thresh = 0.7)
-        : wordMap(map), threshold(thresh) {}
+    bool erase(const string& key) override {
+        size_t index = hash(key);
+        for (int i = 0; i < size; i++) {
+            size_t currentIndex = (index + i) % size;
+            if (!table[currentIndex].first) return false;
+            if (table[currentIndex].second.word == key) {
+                eraseSlot(currentIndex);
+                return true;
+            }
+        }
+        return false;
+    }
 
-    pair<bool, double> classifyWithProbability(const vector<string>& emailWords) {
-        double spamScore = 0.0, totalWords = 0.0;
+    size_t eraseIf(const function<bool(const WordFreq&)>& pred) override {
+        // Start just after an empty slot: no cluster wraps into the scan, so every
+        // entry shifted into a hole comes from ahead and is still examined
+        size_t start = 0;
+        while (start < (size_t)size && table[start].first) start++;
+        if (start == (size_t)size) {
+            vector<string> doomed;
+            forEach([&](const WordFreq& wf) { if (pred(wf)) doomed.push_back(wf.word); });
+            for (const string& key : doomed) erase(key);
+            return doomed.size();
+        }
 
-        for (const string& word : emailWords) {
-            WordFreq* wf = wordMap->search(word);
-            if (wf) {
-                double totalFreq = wf->spamFreq + wf->hamFreq;
-                if (totalFreq > 0) {
-                    spamScore += (wf->spamFreq / totalFreq);
-                    totalWords += 1.0;
-                }
+        size_t removed = 0;
+        for (size_t step = 1; step < (size_t)size;) {
+            size_t i = (start + step) % size;
+            if (table[i].first && pred(table[i].second)) {
+                eraseSlot(i);
+                removed++;
+            } else {
+                step++;
             }
         }
+        return removed;
+    }
 
-        double prob = (totalWords > 0) ? (spamScore / totalWords) : 0.0;
-        return {prob >= threshold, prob};
+    void forEach(const function<void(const WordFreq&)>& visit) const override {
+        for (const auto& slot : table)
+            if (slot.first) visit(slot.second);
     }
 
-    void setThreshold(double thresh) {
-        threshold = thresh;
+    size_t memoryUsage() const override {
+        size_t bytes = table.capacity() * sizeof(table[0]);
+        forEach([&](const WordFreq& wf) { bytes += keyHeapBytes(wf.word); });
+        return bytes;
+    }
+
+    HashMapStats collectStats() const override {
+        HashMapStats stats;
+        stats.buckets = size;
+        stats.entries = count;
+        size_t probeTotal = 0;
+        for (size_t i = 0; i < table.size(); ++i) {
+            if (!table[i].first) continue;
+            stats.occupiedBuckets++;
+            size_t home = hash(table[i].second.word);
+            size_t probe = (i + size - home) % size + 1;
+            if (probe > 1) stats.collisions++;
+            probeTotal += probe;
+            stats.maxProbeLength = max(stats.maxProbeLength, probe);
+        }
+        stats.avgProbeLength = count > 0 ? (double)probeTotal / count : 0.0;
+        return stats;
     }
 };
 
-// Utility to split CSV lines
-vector<string> splitCSVLine(const string& line) {
-    vector<string> tokens;
-    stringstream ss(line);
-    string token;
+// Open addressing with a separate control-byte array (Swiss table layout). Each
+// control byte holds a 7-bit fingerprint of the key's hash, or EMPTY/DELETED.
+// Lookups scan a whole group of control bytes at once (32 with AVX2, 16 with
+// SSE2, a scalar loop otherwise) and compare full keys only on fingerprint
+// matches. The table doubles when it passes 7/8 occupancy.
+class SwissHashMap : public HashMap {
+private:
+#if defined(__AVX2__)
+    static constexpr size_t GROUP_WIDTH = 32;
+#else
+    static constexpr size_t GROUP_WIDTH = 16;
+#endif
+    static constexpr int8_t CTRL_EMPTY = -128;
+    static constexpr int8_t CTRL_DELETED = -2;
+
+    vector<int8_t> ctrl;
+    vector<WordFreq> slots;
+    size_t groupMask = 0;
+    size_t tombstones = 0;
+
+    // Bit i set where ctrl[group + i] == value
+    uint32_t matchByte(size_t group, int8_t value) const {
+        const int8_t* p = &ctrl[group * GROUP_WIDTH];
+#if defined(__AVX2__)
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(value)));
+#elif defined(__SSE2__)
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i)
+            if (p[i] == value) mask |= 1u << i;
+        return mask;
+#endif
+    }
 
-    while (getline(ss, token, ',')) {
-        if (!token.empty() && token.front() == '"' && token.back() == '"') {
-            token = token.substr(1, token.length() - 2);
+    static int8_t fingerprint(uint64_t h) { return (int8_t)(h & 0x7F); }
+    size_t homeGroup(uint64_t h) const { return (h >> 7) & groupMask; }
+
+    // Slot holding key, or SIZE_MAX; groupsProbed counts groups scanned
+    size_t findSlot(const string& key, uint64_t h, uint64_t& groupsProbed) const {
+        groupsProbed = 0;
+        if (slots.empty()) return SIZE_MAX;
+        int8_t fp = fingerprint(h);
+        size_t group = homeGroup(h);
+        for (size_t step = 1; step <= groupMask + 1; group = (group + step++) & groupMask) {
+            groupsProbed++;
+            for (uint32_t m = matchByte(group, fp); m; m &= m - 1) {
+                size_t slot = group * GROUP_WIDTH + __builtin_ctz(m);
+                if (slots[slot].word == key) return slot;
+            }
+            if (matchByte(group, CTRL_EMPTY)) break;
         }
-        tokens.push_back(token);
+        return SIZE_MAX;
     }
-    return tokens;
-}
 
-// Load word frequencies from CSV
-void loadWordFrequenciesFromTransposedCSV(const string& filename, HashMap* chainMap, HashMap* openMap, vector<string>& wordsOrder) {
-    ifstream file(filename);
-    if (!file.is_open()) {
-        cerr << "Error opening file: " << filename << endl;
-        return;
+    // First EMPTY or DELETED slot on the key's probe sequence
+    size_t findFreeSlot(uint64_t h) const {
+        size_t group = homeGroup(h);
+        for (size_t step = 1;; group = (group + step++) & groupMask) {
+            uint32_t m = matchByte(group, CTRL_EMPTY) | matchByte(group, CTRL_DELETED);
+            if (m) return group * GROUP_WIDTH + __builtin_ctz(m);
+        }
     }
 
-    string wordsLine, spamLine, hamLine;
-    getline(file, wordsLine);
-    getline(file, spamLine);
-    getline(file, hamLine);
-
-    vector<string> words = splitCSVLine(wordsLine);
-    vector<string> spamCounts = splitCSVLine(spamLine);
-    vector<string> hamCounts = splitCSVLine(hamLine);
+    void rehash(size_t newCapacity) {
+        vector<int8_t> oldCtrl;
+        vector<WordFreq> oldSlots;
+        oldCtrl.swap(ctrl);
+        oldSlots.swap(slots);
+        ctrl.assign(newCapacity, CTRL_EMPTY);
+        slots.assign(newCapacity, WordFreq());
+        groupMask = newCapacity / GROUP_WIDTH - 1;
+        size = newCapacity;
+        tombstones = 0;
+        for (size_t i = 0; i < oldCtrl.size(); ++i) {
+            if (oldCtrl[i] < 0) continue;
+            uint64_t h = hashKey(oldSlots[i].word);
+            size_t slot = findFreeSlot(h);
+            ctrl[slot] = fingerprint(h);
+            slots[slot] = move(oldSlots[i]);
+        }
+    }
 
-    if (spamCounts.size() != words.size() || hamCounts.size() != words.size()) {
-        cerr << "Error: Inconsistent number of columns in CSV file" << endl;
-        return;
+    void eraseSlot(size_t slot) {
+        // A slot may become EMPTY only if its group already has one: no probe
+        // sequence can have continued past such a group
+        size_t group = slot / GROUP_WIDTH;
+        if (matchByte(group, CTRL_EMPTY)) {
+            ctrl[slot] = CTRL_EMPTY;
+        } else {
+            ctrl[slot] = CTRL_DELETED;
+            tombstones++;
+        }
+        slots[slot] = WordFreq();
+        count--;
     }
 
-    for (size_t i = 0; i < words.size(); ++i) {
-        if (words[i].empty() || words[i] == "Word" || words[i] == "word") continue;
+public:
+    SwissHashMap(int s = 16, HashFunction hf = HASH_WYHASH) : HashMap(0, hf) {
+        size_t capacity = GROUP_WIDTH;
+        while (capacity < (size_t)s) capacity <<= 1;
+        rehash(capacity);
+    }
 
-        try {
-            double spamFreq = stod(spamCounts[i]);
-            double hamFreq = stod(hamCounts[i]);
-            WordFreq wordFreq(words[i], spamFreq, hamFreq);
-            chainMap->insert(wordFreq);
-            openMap->insert(wordFreq);
-            wordsOrder.push_back(words[i]);
-        } catch (...) {
-            cerr << "Error processing column " << i + 1 << ": " << words[i] << endl;
+    void insert(WordFreq data) override {
+        uint64_t h = hashKey(data.word), probes;
+        size_t slot = findSlot(data.word, h, probes);
+        if (slot != SIZE_MAX) {
+            slots[slot] = data;
+            return;
         }
+        if ((count + tombstones + 1) * 8 > (size_t)size * 7) {
+            rehash((size_t)count * 2 + 2 > (size_t)size ? size * 2 : size);
+        }
+        slot = findFreeSlot(h);
+        if (ctrl[slot] == CTRL_DELETED) tombstones--;
+        ctrl[slot] = fingerprint(h);
+        slots[slot] = data;
+        count++;
     }
 
-    file.close();
-}
+    WordFreq* search(const string& key) override {
+        uint64_t probes;
+        size_t slot = findSlot(key, hashKey(key), probes);
+        recordLookup(slot != SIZE_MAX, probes);
+        return slot != SIZE_MAX ? &slots[slot] : nullptr;
+    }
 
-// Save updated word frequencies to CSV
-void saveWordFrequenciesToTransposedCSV(const string& filename, const vector<string>& wordsOrder, HashMap* wordMap) {
-    ofstream file(filename);
-    if (!file.is_open()) {
-        cerr << "Error opening file for writing: " << filename << endl;
-        return;
+    void clear() override {
+        ctrl.assign(ctrl.size(), CTRL_EMPTY);
+        slots.assign(slots.size(), WordFreq());
+        tombstones = 0;
+        count = 0;
     }
 
-    for (size_t i = 0; i < wordsOrder.size(); ++i) {
-        if (i > 0) file << ",";
-        file << "\"" << wordsOrder[i] << "\"";
+    bool erase(const string& key) override {
+        uint64_t probes;
+        size_t slot = findSlot(key, hashKey(key), probes);
+        if (slot == SIZE_MAX) return false;
+        eraseSlot(slot);
+        return true;
     }
-    file << endl;
 
-    for (size_t i = 0; i < wordsOrder.size(); ++i) {
-        if (i > 0) file << ",";
-        WordFreq* wf = wordMap->search(wordsOrder[i]);
-        file << (wf ? wf->spamFreq : 0);
+    size_t eraseIf(const function<bool(const WordFreq&)>& pred) override {
+        size_t removed = 0;
+        for (size_t i = 0; i < ctrl.size(); ++i) {
+            if (ctrl[i] >= 0 && pred(slots[i])) {
+                eraseSlot(i);
+                removed++;
+            }
+        }
+        return removed;
     }
-    file << endl;
 
-    for (size_t i = 0; i < wordsOrder.size(); ++i) {
-        if (i > 0) file << ",";
-        WordFreq* wf = wordMap->search(wordsOrder[i]);
-        file << (wf ? wf->hamFreq : 0);
+    void forEach(const function<void(const WordFreq&)>& visit) const override {
+        for (size_t i = 0; i < ctrl.size(); ++i)
+            if (ctrl[i] >= 0) visit(slots[i]);
     }
-    file << endl;
 
-    file.close();
-}
+    size_t memoryUsage() const override {
+        size_t bytes = ctrl.capacity() + slots.capacity() * sizeof(WordFreq);
+        forEach([&](const WordFreq& wf) { bytes += keyHeapBytes(wf.word); });
+        return bytes;
+    }
 
-// Application data structure
-struct AppData {
-    GtkWidget* window;
-    GtkWidget* textView;
-    GtkWidget* classifyButton;
-    GtkWidget* clearButton;
-    GtkWidget* loadButton;
-    GtkWidget* viewDatasetButton;
-    GtkWidget* resultLabel;
-    GtkWidget* markSpamButton;
-    GtkWidget* markHamButton;
-    vector<string> wordsOrder;
-    ChainingHashMap chainMap;
-    OpenAddressingHashMap openMap;
-    vector<string> currentEmailWords;
-    double spamThreshold; // Added to store threshold
+    // Probe lengths are counted in groups scanned
+    HashMapStats collectStats() const override {
+        HashMapStats stats;
+        stats.buckets = size;
+        stats.entries = count;
+        size_t probeTotal = 0;
+        for (size_t i = 0; i < ctrl.size(); ++i) {
+            if (ctrl[i] < 0) continue;
+            stats.occupiedBuckets++;
+            uint64_t probes;
+            findSlot(slots[i].word, hashKey(slots[i].word), probes);
+            if (probes > 1) stats.collisions++;
+            probeTotal += probes;
+            stats.maxProbeLength = max(stats.maxProbeLength, (size_t)probes);
+        }
+        stats.avgProbeLength = count > 0 ? (double)probeTotal / count : 0.0;
+        return stats;
+    }
 };
 
-// Color functions for highlighting
-const char* get_spam_color(int level) {
-    switch (level) {
-        case 1: return "#FFCCCC"; // light red
-        case 2: return "#FF9999";
-        case 3: return "#FF6666";
-        case 4: return "#FF3333";
-        case 5: return "#FF0000"; // dark red
-        default: return "#FFFFFF";
+// Read-optimized model: 16-byte slots with 32-bit counts and keys stored inline
+// when they fit in 7 bytes, otherwise as an offset into a shared string pool.
+// An optional 8- or 16-bit quantized spam probability is kept in a parallel array.
+class CompactWordTable : public WordLookup {
+private:
+    static constexpr uint8_t POOLED_KEY = 0xFF;
+    static constexpr size_t INLINE_KEY_MAX = 7;
+
+    struct Entry {
+        char key[7];       // inline key bytes, or pool offset (4 bytes) + length (3 bytes)
+        uint8_t keyLength; // 0 = empty slot, 1..7 = inline, POOLED_KEY = pooled
+        uint32_t spamCount;
+        uint32_t hamCount;
+    };
+    static_assert(sizeof(Entry) == 16, "compact entries must stay 16 bytes");
+
+    vector<Entry> slots;
+    vector<uint8_t> scores8;
+    vector<uint16_t> scores16;
+    string pool;
+    size_t mask = 0;
+    size_t count = 0;
+    int scoreBits;
+
+    bool keyEquals(const Entry& e, const string& key) const {
+        if (e.keyLength != POOLED_KEY)
+            return e.keyLength == key.size() && memcmp(e.key, key.data(), key.size()) == 0;
+        uint32_t offset = 0, length = 0;
+        memcpy(&offset, e.key, 4);
+        memcpy(&length, e.key + 4, 3);
+        return length == key.size() && pool.compare(offset, length, key) == 0;
     }
-}
 
-const char* get_ham_color(int level) {
-    switch (level) {
-        case 1: return "#CCFFCC"; // light green
-        case 2: return "#99FF99";
-        case 3: return "#66FF66";
-        case 4: return "#33FF33";
-        case 5: return "#00FF00"; // dark green
-        default: return "#FFFFFF";
+    const Entry* find(const string& key, size_t& slot) const {
+        if (slots.empty()) return nullptr;
+        for (slot = wyhash64(key.data(), key.size()) & mask; slots[slot].keyLength != 0; slot = (slot + 1) & mask) {
+            if (keyEquals(slots[slot], key)) return &slots[slot];
+        }
+        return nullptr;
     }
-}
 
-// Highlight words in the text view
-void highlightWords(GtkTextBuffer* buffer, const vector<string>& emailWords, HashMap* wordMap) {
-    GtkTextIter start, end;
-    gtk_text_buffer_get_start_iter(buffer, &start);
-    gtk_text_buffer_get_end_iter(buffer, &end);
-    gtk_text_buffer_remove_all_tags(buffer, &start, &end);
+    static uint32_t toCount(double value) {
+        if (value <= 0) return 0;
+        return value >= 4294967295.0 ? 4294967295u : (uint32_t)llround(value);
+    }
 
-    gchar* text = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
-    string textStr(text);
-    g_free(text);
+public:
+    // scoreBits: 0 (no quantized score), 8 or 16
+    CompactWordTable(int bits = 0) : scoreBits(bits) {}
+
+    void build(const vector<WordFreq>& words) {
+        size_t capacity = 16;
+        while (capacity * 3 < words.size() * 4) capacity <<= 1; // load factor <= 0.75
+        slots.assign(capacity, Entry{});
+        scores8.assign(scoreBits == 8 ? capacity : 0, 0);
+        scores16.assign(scoreBits == 16 ? capacity : 0, 0);
+        pool.clear();
+        mask = capacity - 1;
+        count = 0;
 
-    size_t pos = 0;
-    string word;
-    size_t wordStartPos = 0;
-    bool inWord = false;
-
-    for (size_t i = 0; i <= textStr.size(); ++i) {
-        char c = (i < textStr.size()) ? textStr[i] : ' ';
-        if (isalnum(c)) {
-            if (!inWord) {
-                wordStartPos = i;
-                inWord = true;
-            }
-            word += c;
-        } else {
-            if (inWord) {
-                inWord = false;
-                WordFreq* wf = wordMap->search(word);
-                if (wf) {
-                    double totalFreq = wf->spamFreq + wf->hamFreq;
-                    if (totalFreq > 0) {
-                        double contribution = (wf->spamFreq - wf->hamFreq) / totalFreq;
-                        string tagName;
-                        if (contribution > 0) {
-                            int level = min(5, static_cast<int>(contribution / 0.2) + 1);
-                            tagName = "spam-" + to_string(level);
-                            cout << "Word: " << word << ", Contribution: " << contribution << ", Spam Level: " << level << endl;
-                        } else if (contribution < 0) {
-                            int level = min(5, static_cast<int>(-contribution / 0.2) + 1);
-                            tagName = "ham-" + to_string(level);
-                            cout << "Word: " << word << ", Contribution: " << contribution << ", Ham Level: " << level << endl;
-                        }
-                        if (!tagName.empty()) {
-                            GtkTextIter wordStart, wordEnd;
-                            gtk_text_buffer_get_iter_at_offset(buffer, &wordStart, wordStartPos);
-                            gtk_text_buffer_get_iter_at_offset(buffer, &wordEnd, i);
-                            gtk_text_buffer_apply_tag_by_name(buffer, tagName.c_str(), &wordStart, &wordEnd);
-                        }
-                    }
+        for (const WordFreq& wf : words) {
+            if (wf.word.empty() || wf.word.size() >= (1u << 24)) continue;
+            if (wf.word.size() > INLINE_KEY_MAX && pool.size() + wf.word.size() > UINT32_MAX) continue;
+            size_t slot = 0;
+            Entry* e = const_cast<Entry*>(find(wf.word, slot));
+            if (!e) {
+                e = &slots[slot];
+                if (wf.word.size() <= INLINE_KEY_MAX) {
+                    memcpy(e->key, wf.word.data(), wf.word.size());
+                    e->keyLength = wf.word.size();
+                } else {
+                    uint32_t offset = pool.size(), length = wf.word.size();
+                    pool += wf.word;
+                    memcpy(e->key, &offset, 4);
+                    memcpy(e->key + 4, &length, 3);
+                    e->keyLength = POOLED_KEY;
                 }
-                word.clear();
+                count++;
             }
+            e->spamCount = toCount(wf.spamFreq);
+            e->hamCount = toCount(wf.hamFreq);
+
+            double total = (double)e->spamCount + e->hamCount;
+            double probability = total > 0 ? e->spamCount / total : 0.0;
+            if (scoreBits == 8) scores8[slot] = (uint8_t)lround(probability * 255.0);
+            if (scoreBits == 16) scores16[slot] = (uint16_t)lround(probability * 65535.0);
         }
+        pool.shrink_to_fit();
+    }
+
+    bool lookupCounts(const string& word, double& spamFreq, double& hamFreq) override {
+        size_t slot;
+        const Entry* e = find(word, slot);
+        if (!e) return false;
+        spamFreq = e->spamCount;
+        hamFreq = e->hamCount;
+        return true;
+    }
+
+    bool lookupSpamProbability(const string& word, double& probability) override {
+        size_t slot;
+        const Entry* e = find(word, slot);
+        if (!e || (e->spamCount == 0 && e->hamCount == 0)) return false;
+        if (scoreBits == 8) probability = scores8[slot] / 255.0;
+        else if (scoreBits == 16) probability = scores16[slot] / 65535.0;
+        else probability = (double)e->spamCount / ((double)e->spamCount + e->hamCount);
+        return true;
+    }
+
+    size_t getCount() const { return count; }
+
+    size_t memoryUsage() const {
+        return slots.capacity() * sizeof(Entry) + scores8.capacity() + scores16.capacity() * 2 + pool.capacity();
+    }
+
+    double bytesPerWord() const { return count ? (double)memoryUsage() / count : 0.0; }
+};
+
+// Read-only compressed (radix) trie mapping words to value indices. Chains of
+// single-child nodes are collapsed into one edge, so shared prefixes (deal,
+// deals, dealer, ...) are stored once, and identical edge labels - typically
+// common endings such as "s", "ing" or "er" - share one copy in the label pool.
+// The children of a node are contiguous and sorted by first byte, which gives
+// binary-searched exact lookups and in-order prefix iteration.
+class CompressedTrie {
+public:
+    static constexpr uint32_t NO_VALUE = UINT32_MAX;
+
+private:
+    struct Node {
+        uint32_t labelOffset; // edge label leading into this node, in labels
+        uint32_t firstChild;
+        uint32_t value;       // NO_VALUE unless a word ends here
+        uint16_t childCount;
+        uint8_t labelLength;
+        uint8_t firstByte;    // labels[labelOffset], kept inline for the child search
+    };
+    static_assert(sizeof(Node) == 16, "trie nodes must stay 16 bytes");
+
+    vector<Node> nodes;
+    string labels;
+    size_t count = 0;
+
+    // Child of `node` whose edge starts with byte c, or null
+    const Node* child(const Node& node, unsigned char c) const {
+        const Node* first = nodes.data() + node.firstChild;
+        const Node* last = first + node.childCount;
+        const Node* it = lower_bound(first, last, c, [](const Node& n, unsigned char b) { return n.firstByte < b; });
+        return it != last && it->firstByte == c ? it : nullptr;
+    }
+
+    void visitSubtree(const Node& node, string& word, const function<void(const string&, uint32_t)>& onWord) const {
+        size_t length = word.size();
+        word.append(labels, node.labelOffset, node.labelLength);
+        if (node.value != NO_VALUE) onWord(word, node.value);
+        for (uint32_t i = 0; i < node.childCount; ++i) visitSubtree(nodes[node.firstChild + i], word, onWord);
+        word.resize(length);
+    }
+
+public:
+    // Value index of each word is its position in keys; for duplicates the first wins
+    void build(const vector<string>& keys) {
+        vector<uint32_t> order(keys.size());
+        for (uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+        order.erase(unique(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] == keys[b]; }),
+                    order.end());
+
+        nodes.assign(1, Node{0, 0, NO_VALUE, 0, 0, 0});
+        labels.clear();
+        count = order.size();
+        map<string, uint32_t> internedLabels;
+
+        // Breadth-first, so the children of each node are created together.
+        // Each pending node covers sorted keys [begin, end) sharing `depth` bytes.
+        struct Pending {
+            uint32_t node;
+            size_t begin, end, depth;
+        };
+        deque<Pending> pending = {{0, 0, order.size(), 0}};
+        while (!pending.empty()) {
+            Pending p = pending.front();
+            pending.pop_front();
+            if (p.begin < p.end && keys[order[p.begin]].size() == p.depth) nodes[p.node].value = order[p.begin++];
+
+            uint32_t firstChild = nodes.size(), children = 0;
+            for (size_t groupBegin = p.begin; groupBegin < p.end;) {
+                const string& first = keys[order[groupBegin]];
+                size_t groupEnd = groupBegin + 1;
+                while (groupEnd < p.end && keys[order[groupEnd]][p.depth] == first[p.depth]) ++groupEnd;
+
+                // Sorted keys: the group's common prefix is that of its first and last key
+                const string& last = keys[order[groupEnd - 1]];
+                size_t common = p.depth;
+                while (common < first.size() && common < last.size() && first[common] == last[common]) ++common;
+                size_t labelLength = min<size_t>(common - p.depth, 255);
+
+                string label = first.substr(p.depth, labelLength);
+                auto interned = internedLabels.find(label);
+                uint32_t labelOffset;
+                if (interned != internedLabels.end()) {
+                    labelOffset = interned->second;
+                } else {
+                    labelOffset = labels.size();
+                    labels += label;
+                    internedLabels.emplace(label, labelOffset);
+                }
+                nodes.push_back(Node{labelOffset, 0, NO_VALUE, 0, (uint8_t)labelLength, (uint8_t)label[0]});
+                pending.push_back({(uint32_t)nodes.size() - 1, groupBegin, groupEnd, p.depth + labelLength});
+                children++;
+                groupBegin = groupEnd;
+            }
+            nodes[p.node].firstChild = firstChild;
+            nodes[p.node].childCount = children;
+        }
+        nodes.shrink_to_fit();
+        labels.shrink_to_fit();
+    }
+
+    // Value index of an exact word, or NO_VALUE
+    uint32_t find(const string& word) const {
+        if (nodes.empty()) return NO_VALUE;
+        const Node* node = &nodes[0];
+        for (size_t pos = 0; pos < word.size();) {
+            node = child(*node, word[pos]);
+            if (!node || word.size() - pos < node->labelLength ||
+                labels.compare(node->labelOffset, node->labelLength, word, pos, node->labelLength) != 0)
+                return NO_VALUE;
+            pos += node->labelLength;
+        }
+        return node->value;
+    }
+
+    // Every word starting with prefix, in lexicographic order
+    void forEachWithPrefix(const string& prefix, const function<void(const string&, uint32_t)>& onWord) const {
+        if (nodes.empty()) return;
+        const Node* node = &nodes[0];
+        string word;
+        size_t pos = 0;
+        while (pos < prefix.size()) {
+            node = child(*node, prefix[pos]);
+            if (!node) return;
+            size_t compared = min<size_t>(node->labelLength, prefix.size() - pos);
+            if (labels.compare(node->labelOffset, compared, prefix, pos, compared) != 0) return;
+            pos += node->labelLength;
+            if (pos <= prefix.size()) word.append(labels, node->labelOffset, node->labelLength);
+        }
+        // The prefix may end inside the last edge; that node's subtree still matches
+        if (pos > prefix.size()) {
+            visitSubtree(*node, word, onWord);
+            return;
+        }
+        if (node->value != NO_VALUE) onWord(word, node->value);
+        for (uint32_t i = 0; i < node->childCount; ++i) visitSubtree(nodes[node->firstChild + i], word, onWord);
+    }
+
+    size_t getCount() const { return count; }
+    size_t memoryUsage() const { return nodes.capacity() * sizeof(Node) + labels.capacity(); }
+};
+
+// Word counts stored behind a compressed trie: the trie maps a word to its index
+// in two 32-bit count arrays
+class TrieWordTable : public WordLookup {
+private:
+    CompressedTrie trie;
+    vector<uint32_t> spamCounts;
+    vector<uint32_t> hamCounts;
+
+    static uint32_t toCount(double value) {
+        if (value <= 0) return 0;
+        return value >= 4294967295.0 ? 4294967295u : (uint32_t)llround(value);
+    }
+
+public:
+    void build(const vector<WordFreq>& words) {
+        vector<string> keys;
+        keys.reserve(words.size());
+        spamCounts.clear();
+        hamCounts.clear();
+        for (const WordFreq& wf : words) {
+            keys.push_back(wf.word);
+            spamCounts.push_back(toCount(wf.spamFreq));
+            hamCounts.push_back(toCount(wf.hamFreq));
+        }
+        trie.build(keys);
+        spamCounts.shrink_to_fit();
+        hamCounts.shrink_to_fit();
+    }
+
+    bool lookupCounts(const string& word, double& spamFreq, double& hamFreq) override {
+        uint32_t index = trie.find(word);
+        if (index == CompressedTrie::NO_VALUE) return false;
+        spamFreq = spamCounts[index];
+        hamFreq = hamCounts[index];
+        return true;
+    }
+
+    size_t getCount() const { return trie.getCount(); }
+
+    size_t memoryUsage() const {
+        return trie.memoryUsage() + (spamCounts.capacity() + hamCounts.capacity()) * sizeof(uint32_t);
+    }
+};
+
+// Upper bound on the work spent on one message. Anything larger is scored from
+// a sample, so the cost of a message no longer grows with its size.
+struct MessageBudget {
+    size_t maxBytes = 1 << 20;
+    size_t maxTokens = 20000;
+
+    // SPAM_MAX_MESSAGE_BYTES / SPAM_MAX_MESSAGE_TOKENS override the defaults
+    static MessageBudget fromEnvironment() {
+        MessageBudget budget;
+        const char* bytesEnv = getenv("SPAM_MAX_MESSAGE_BYTES");
+        if (bytesEnv && atol(bytesEnv) > 0) budget.maxBytes = (size_t)atol(bytesEnv);
+        const char* tokensEnv = getenv("SPAM_MAX_MESSAGE_TOKENS");
+        if (tokensEnv && atol(tokensEnv) > 0) budget.maxTokens = (size_t)atol(tokensEnv);
+        return budget;
+    }
+};
+
+// Pick [begin, end) ranges covering `budget` of `total` units: a quarter from the
+// head, a quarter from the tail and the rest as equal windows centred in
+// equal-width strata of the middle, so every region of the message is represented.
+// What does not divide evenly goes to the head, so the ranges always add up to budget.
+vector<pair<size_t, size_t>> sampleRanges(size_t total, size_t budget, size_t strata = 8) {
+    if (total <= budget) return {{0, total}};
+    size_t head = budget / 4, tail = budget / 4;
+    size_t window = (budget - head - tail) / strata;
+    head = budget - tail - window * strata;
+    size_t middleBegin = head, middleEnd = total - tail;
+
+    vector<pair<size_t, size_t>> ranges;
+    ranges.push_back({0, head});
+    if (window > 0) {
+        double stratumWidth = (double)(middleEnd - middleBegin) / strata;
+        for (size_t i = 0; i < strata; ++i) {
+            size_t centre = middleBegin + (size_t)(stratumWidth * (i + 0.5));
+            size_t begin = centre - min(centre - middleBegin, window / 2);
+            ranges.push_back({begin, min(begin + window, middleEnd)});
+        }
+    }
+    ranges.push_back({middleEnd, total});
+    return ranges;
+}
+
+// Verdict for one message
+struct ClassificationResult {
+    bool isSpam = false;
+    double probability = 0.0;
+    bool sampled = false; // scored from a sample because the message exceeded its budget
+};
+
+// EmailClassifier with probability
+class EmailClassifier {
+private:
+    WordLookup* wordMap;
+    double threshold;
+    size_t maxTokens;
+
+public:
+    EmailClassifier(WordLookup* map, double thresh = 0.7, size_t tokenBudget = MessageBudget().maxTokens)
+        : wordMap(map), threshold(thresh), maxTokens(tokenBudget) {}
+
+    // Resolve every word's spam probability; words the model can't score are -1
+    vector<double> lookupWords(const vector<string>& emailWords) {
+        PhaseTimer timer(PHASE_LOOKUP);
+        vector<double> probabilities;
+        probabilities.reserve(min(emailWords.size(), maxTokens));
+        for (const auto& range : sampleRanges(emailWords.size(), maxTokens)) {
+            for (size_t i = range.first; i < range.second; ++i) {
+                double probability;
+                probabilities.push_back(wordMap->lookupSpamProbability(emailWords[i], probability) ? probability : -1.0);
+            }
+        }
+        return probabilities;
+    }
+
+    // Average spam probability of the words found in the model
+    pair<bool, double> scoreLookups(const vector<double>& probabilities) {
+        PhaseTimer timer(PHASE_SCORE);
+        double spamScore = 0.0, totalWords = 0.0;
+
+        for (double probability : probabilities) {
+            if (probability >= 0) {
+                spamScore += probability;
+                totalWords += 1.0;
+            }
+        }
+
+        double prob = (totalWords > 0) ? (spamScore / totalWords) : 0.0;
+        return {prob >= threshold, prob};
+    }
+
+    pair<bool, double> classifyWithProbability(const vector<string>& emailWords) {
+        return scoreLookups(lookupWords(emailWords));
+    }
+
+    // Scores at most the token budget; inputSampled carries over an earlier byte-level sample
+    ClassificationResult classify(const vector<string>& emailWords, bool inputSampled = false) {
+        pair<bool, double> verdict = classifyWithProbability(emailWords);
+        ClassificationResult result;
+        result.isSpam = verdict.first;
+        result.probability = verdict.second;
+        result.sampled = inputSampled || emailWords.size() > maxTokens;
+        return result;
+    }
+
+    void setThreshold(double thresh) {
+        threshold = thresh;
+    }
+};
+
+// Identity of a file's contents as far as stat can tell
+struct FileStamp {
+    bool valid = false;
+    dev_t device = 0;
+    ino_t inode = 0;
+    off_t size = 0;
+    int64_t mtimeNanos = 0;
+
+    bool operator==(const FileStamp& other) const {
+        return valid == other.valid && device == other.device && inode == other.inode && size == other.size &&
+               mtimeNanos == other.mtimeNanos;
+    }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+FileStamp stampOf(const struct stat& st) {
+    FileStamp stamp;
+    stamp.valid = true;
+    stamp.device = st.st_dev;
+    stamp.inode = st.st_ino;
+    stamp.size = st.st_size;
+    stamp.mtimeNanos = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return stamp;
+}
+
+// Told a new file's stamp before the file is renamed into place
+typedef function<void(const FileStamp&)> StampListener;
+
+FileStamp statFile(const string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return FileStamp();
+    return stampOf(st);
+}
+
+// Writes a file through a large buffer into a temporary next to it, then
+// fsyncs and renames it into place, so readers only ever see the old or the
+// new file. Numbers are formatted with to_chars. The temporary is removed if
+// the file is never committed.
+class AtomicFileWriter {
+private:
+    static constexpr size_t BUFFER_SIZE = 1 << 20;
+
+    string path;
+    string tmpPath;
+    int fd = -1;
+    bool failed = false;
+    vector<char> buffer;
+    size_t used = 0;
+
+    void writeAll(const char* data, size_t length) {
+        while (length > 0 && !failed) {
+            ssize_t written = ::write(fd, data, length);
+            if (written < 0) {
+                if (errno != EINTR) failed = true;
+                continue;
+            }
+            data += written;
+            length -= written;
+        }
+    }
+
+    void flush() {
+        writeAll(buffer.data(), used);
+        used = 0;
+    }
+
+public:
+    explicit AtomicFileWriter(const string& filename)
+        : path(filename), tmpPath(filename + ".tmp"), buffer(BUFFER_SIZE) {
+        fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            cerr << "Error opening file for writing: " << tmpPath << endl;
+            failed = true;
+        }
+    }
+
+    ~AtomicFileWriter() {
+        if (fd >= 0) {
+            ::close(fd);
+            unlink(tmpPath.c_str());
+        }
+    }
+
+    AtomicFileWriter(const AtomicFileWriter&) = delete;
+    AtomicFileWriter& operator=(const AtomicFileWriter&) = delete;
+
+    void append(const char* data, size_t length) {
+        if (used + length > buffer.size()) flush();
+        if (length >= buffer.size()) {
+            writeAll(data, length);
+            return;
+        }
+        memcpy(buffer.data() + used, data, length);
+        used += length;
+    }
+
+    void append(const string& text) { append(text.data(), text.size()); }
+    void append(char c) { append(&c, 1); }
+
+    template <typename T>
+    void appendRaw(const T& value) {
+        append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    // Same text as an ostream with setprecision(15)
+    void appendNumber(double value) {
+        if (buffer.size() - used < 32) flush();
+        used = to_chars(buffer.data() + used, buffer.data() + buffer.size(), value, chars_format::general, 15).ptr -
+               buffer.data();
+    }
+
+    // Flush, fsync and rename over the target, then fsync the directory so the
+    // rename survives a crash too. beforeRename is given the new file's stamp
+    // while the old file is still in place; rename does not change the stamp.
+    bool commit(const StampListener& beforeRename = nullptr) {
+        if (fd < 0) return false;
+        flush();
+        struct stat st;
+        bool ok = !failed && fsync(fd) == 0 && fstat(fd, &st) == 0;
+        ok = ::close(fd) == 0 && ok;
+        fd = -1;
+        if (ok && beforeRename) beforeRename(stampOf(st));
+        if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) {
+            unlink(tmpPath.c_str());
+            cerr << "Error writing file: " << path << endl;
+            return false;
+        }
+        string directory = filesystem::path(path).parent_path().string();
+        int directoryFd = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (directoryFd >= 0) {
+            fsync(directoryFd);
+            ::close(directoryFd);
+        }
+        return true;
+    }
+};
+
+// Hashing-trick scorer: unigrams and adjacent-word bigrams are hashed straight
+// from the token stream into a fixed array of spam/ham counters. No strings are
+// stored and memory is fixed at 8 bytes per counter slot.
+class FeatureHashedScorer {
+private:
+    struct Counter {
+        uint32_t spam;
+        uint32_t ham;
+    };
+
+    static constexpr uint64_t UNIGRAM_SEED = 0x1f83d9abfb41bd6bull;
+    static constexpr uint64_t BIGRAM_SEED = 0x5be0cd19137e2179ull;
+    static constexpr char FILE_MAGIC[4] = {'S', 'P', 'F', 'H'};
+
+    vector<Counter> table;
+    size_t mask;
+    int bits;
+
+    static uint64_t tokenHash(const string& token) {
+        return wyhash64(token.data(), token.size(), UNIGRAM_SEED);
+    }
+
+    // Visit the table index of every unigram and bigram in the token stream
+    template <typename Visit>
+    void forEachFeature(const vector<string>& tokens, Visit visit) const {
+        uint64_t prev = 0;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            uint64_t h = tokenHash(tokens[i]);
+            visit(h & mask);
+            if (i > 0) visit(wyMix(prev ^ BIGRAM_SEED, h) & mask);
+            prev = h;
+        }
+    }
+
+public:
+    // 2^bits counter slots
+    FeatureHashedScorer(int tableBits = 20) : bits(tableBits) {
+        table.assign(size_t(1) << bits, Counter{0, 0});
+        mask = table.size() - 1;
+    }
+
+    void train(const vector<string>& tokens, bool isSpam, uint32_t weight = 1) {
+        forEachFeature(tokens, [&](size_t index) {
+            uint32_t& c = isSpam ? table[index].spam : table[index].ham;
+            c = c > UINT32_MAX - weight ? UINT32_MAX : c + weight;
+        });
+    }
+
+    // Table slots a message touches, so callers can batch updates for addToSlot
+    void featureSlots(const vector<string>& tokens, vector<size_t>& slots) const {
+        forEachFeature(tokens, [&](size_t index) { slots.push_back(index); });
+    }
+
+    void addToSlot(size_t index, bool isSpam, uint32_t count) {
+        uint32_t& c = isSpam ? table[index].spam : table[index].ham;
+        c = c > UINT32_MAX - count ? UINT32_MAX : c + count;
+    }
+
+    // Bootstrap unigram counters from a word-frequency model. Words sharing a
+    // slot add up, so the counters saturate like training instead of wrapping.
+    void seedFromModel(const HashMap& wordMap) {
+        auto toCount = [](double value) { return (uint32_t)min(max(value, 0.0), 1e9); };
+        wordMap.forEach([&](const WordFreq& wf) {
+            size_t index = tokenHash(wf.word) & mask;
+            addToSlot(index, true, toCount(wf.spamFreq));
+            addToSlot(index, false, toCount(wf.hamFreq));
+        });
+    }
+
+    // Average spam share over the features that have been seen in training
+    pair<bool, double> classifyWithProbability(const vector<string>& tokens, double threshold = 0.7) const {
+        double spamScore = 0.0, features = 0.0;
+        forEachFeature(tokens, [&](size_t index) {
+            double total = (double)table[index].spam + table[index].ham;
+            if (total > 0) {
+                spamScore += table[index].spam / total;
+                features += 1.0;
+            }
+        });
+        double prob = features > 0 ? spamScore / features : 0.0;
+        return {prob >= threshold, prob};
+    }
+
+    size_t memoryUsage() const { return table.size() * sizeof(Counter); }
+
+    bool save(const string& filename) const {
+        AtomicFileWriter file(filename);
+        uint32_t fileBits = bits;
+        file.append(FILE_MAGIC, 4);
+        file.appendRaw(fileBits);
+        file.append(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(Counter));
+        return file.commit();
+    }
+
+    // Returns false (leaving the table untouched) if the file is missing or was
+    // written with a different table size
+    bool load(const string& filename) {
+        ifstream file(filename, ios::binary);
+        char magic[4];
+        uint32_t fileBits = 0;
+        file.read(magic, 4);
+        file.read(reinterpret_cast<char*>(&fileBits), sizeof(fileBits));
+        if (!file || memcmp(magic, FILE_MAGIC, 4) != 0 || fileBits != (uint32_t)bits) return false;
+        vector<Counter> loaded(table.size());
+        file.read(reinterpret_cast<char*>(loaded.data()), loaded.size() * sizeof(Counter));
+        if (!file) return false;
+        table.swap(loaded);
+        return true;
+    }
+};
+
+// Tokenizer tables. ASCII bytes map to their lowercase form when they are
+// letters or digits and to 0 otherwise; multibyte UTF-8 is decoded and checked
+// against ranges of non-word code points, then case-folded by range.
+struct AsciiWordTable {
+    char lower[128];
+    AsciiWordTable() {
+        for (int c = 0; c < 128; ++c) {
+            bool digit = c >= '0' && c <= '9', upper = c >= 'A' && c <= 'Z', low = c >= 'a' && c <= 'z';
+            lower[c] = digit || low ? (char)c : upper ? (char)(c + 32) : 0;
+        }
+    }
+};
+static const AsciiWordTable ASCII_WORD;
+
+// Code points above U+007F that separate words (punctuation, spaces, symbols, emoji)
+static const uint32_t NON_WORD_RANGES[][2] = {
+    {0x0080, 0x00A9}, {0x00AB, 0x00B4}, {0x00B6, 0x00B9}, {0x00BB, 0x00BF}, {0x00D7, 0x00D7},
+    {0x00F7, 0x00F7}, {0x037E, 0x037E}, {0x0387, 0x0387}, {0x055A, 0x055F}, {0x0589, 0x058A},
+    {0x05BE, 0x05BE}, {0x05C0, 0x05C0}, {0x05C3, 0x05C3}, {0x05F3, 0x05F4}, {0x060C, 0x060D},
+    {0x061B, 0x061F}, {0x066A, 0x066D}, {0x06D4, 0x06D4}, {0x0964, 0x0965}, {0x0E4F, 0x0E4F},
+    {0x2000, 0x206F}, {0x20A0, 0x20CF}, {0x2100, 0x2BFF}, {0x2E00, 0x2E7F}, {0x3000, 0x303F},
+    {0xE000, 0xF8FF}, {0xFE00, 0xFE0F}, {0xFE30, 0xFE4F}, {0xFE50, 0xFE6F}, {0xFEFF, 0xFEFF},
+    {0xFF00, 0xFF0F}, {0xFF1A, 0xFF20}, {0xFF3B, 0xFF40}, {0xFF5B, 0xFF65}, {0xFFF0, 0xFFFF},
+    {0x1F000, 0x1FAFF},
+};
+
+// Case folding ranges: code points in [lo, hi] (every second one when step is 2) add delta
+static const struct { uint32_t lo, hi; int32_t delta; uint32_t step; } FOLD_RANGES[] = {
+    {0x00C0, 0x00D6, 32, 1}, {0x00D8, 0x00DE, 32, 1}, {0x0100, 0x012F, 1, 2}, {0x0132, 0x0137, 1, 2},
+    {0x0139, 0x0148, 1, 2},  {0x014A, 0x0177, 1, 2},  {0x0178, 0x0178, 0x00FF - 0x0178, 1},
+    {0x0179, 0x017E, 1, 2},  {0x0386, 0x0386, 38, 1}, {0x0388, 0x038A, 37, 1}, {0x038C, 0x038C, 64, 1},
+    {0x038E, 0x038F, 63, 1}, {0x0391, 0x03A1, 32, 1}, {0x03A3, 0x03AB, 32, 1}, {0x0400, 0x040F, 80, 1},
+    {0x0410, 0x042F, 32, 1}, {0x0460, 0x0481, 1, 2},  {0x048A, 0x04BF, 1, 2},  {0x0531, 0x0556, 48, 1},
+    {0x1E00, 0x1E95, 1, 2},  {0x1EA0, 0x1EFF, 1, 2},  {0xFF21, 0xFF3A, 32, 1},
+};
+
+bool isWordCodePoint(uint32_t cp) {
+    for (const auto& range : NON_WORD_RANGES) {
+        if (cp < range[0]) return true;
+        if (cp <= range[1]) return false;
+    }
+    return true;
+}
+
+uint32_t foldCodePoint(uint32_t cp) {
+    for (const auto& range : FOLD_RANGES) {
+        if (cp < range.lo) break;
+        if (cp <= range.hi && (cp - range.lo) % range.step == 0) return cp + range.delta;
+    }
+    return cp;
+}
+
+void appendUtf8(string& out, uint32_t cp) {
+    if (cp < 0x800) {
+        out += (char)(0xC0 | (cp >> 6));
+    } else if (cp < 0x10000) {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+    } else {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+    }
+    out += (char)(0x80 | (cp & 0x3F));
+}
+
+// Decode one multibyte UTF-8 sequence at p; returns its length, or 1 for an
+// invalid byte (reported as code point 0xFFFD)
+size_t decodeUtf8(const unsigned char* p, size_t avail, uint32_t& cp) {
+    unsigned char b = p[0];
+    size_t len = b >= 0xF0 && b <= 0xF4 ? 4 : b >= 0xE0 && b <= 0xEF ? 3 : b >= 0xC2 && b <= 0xDF ? 2 : 0;
+    if (len == 0 || len > avail) {
+        cp = 0xFFFD;
+        return 1;
+    }
+    cp = b & (0xFF >> (len + 1));
+    for (size_t k = 1; k < len; ++k) {
+        if ((p[k] & 0xC0) != 0x80) {
+            cp = 0xFFFD;
+            return 1;
+        }
+        cp = (cp << 6) | (p[k] & 0x3F);
+    }
+    if ((len == 3 && (cp < 0x800 || (cp >= 0xD800 && cp <= 0xDFFF))) || (len == 4 && (cp < 0x10000 || cp > 0x10FFFF))) {
+        cp = 0xFFFD;
+        return 1;
+    }
+    return len;
+}
+
+// Visit every word of a UTF-8 text as onToken(lowercasedWord, charStart, charEnd),
+// where offsets count code points. Runs of ASCII are classified and lowercased
+// 16 bytes at a time with SSE2; other bytes go through the UTF-8 path.
+template <typename OnToken>
+void forEachToken(const char* text, size_t len, OnToken onToken) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(text);
+    string word;
+    size_t i = 0, charIndex = 0, tokenStart = 0;
+
+    auto endToken = [&](size_t charEnd) {
+        if (!word.empty()) {
+            onToken(word, tokenStart, charEnd);
+            word.clear();
+        }
+    };
+
+    while (i < len) {
+#if defined(__SSE2__)
+        while (i + 16 <= len) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+            if (_mm_movemask_epi8(bytes)) break; // non-ASCII in this block
+
+            __m128i folded = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+            __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                          _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(bytes, _mm_set1_epi8('9' + 1)));
+            __m128i lowered = _mm_or_si128(_mm_and_si128(alpha, folded), _mm_andnot_si128(alpha, bytes));
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(alpha, digit));
+            alignas(16) char block[16];
+            _mm_store_si128(reinterpret_cast<__m128i*>(block), lowered);
+
+            for (uint32_t pos = 0; pos < 16;) {
+                uint32_t rest = mask >> pos;
+                if (rest & 1) {
+                    uint32_t run = __builtin_ctz(~rest);
+                    if (word.empty()) tokenStart = charIndex + pos;
+                    word.append(block + pos, run);
+                    pos += run;
+                } else {
+                    endToken(charIndex + pos);
+                    pos = rest ? pos + __builtin_ctz(rest) : 16;
+                }
+            }
+            i += 16;
+            charIndex += 16;
+        }
+        if (i >= len) break;
+#endif
+        // Scalar path: one character per iteration
+        unsigned char b = p[i];
+        if (b < 0x80) {
+            char lower = ASCII_WORD.lower[b];
+            if (lower) {
+                if (word.empty()) tokenStart = charIndex;
+                word += lower;
+            } else {
+                endToken(charIndex);
+            }
+            i++;
+        } else {
+            uint32_t cp;
+            size_t n = decodeUtf8(p + i, len - i, cp);
+            if (cp != 0xFFFD && isWordCodePoint(cp)) {
+                if (word.empty()) tokenStart = charIndex;
+                appendUtf8(word, foldCodePoint(cp));
+            } else {
+                endToken(charIndex);
+            }
+            i += n;
+        }
+        charIndex++;
+    }
+    endToken(charIndex);
+}
+
+// Split email text into lowercase words (letters and digits, any script)
+vector<string> tokenizeEmail(const char* emailText, size_t length) {
+    PhaseTimer timer(PHASE_TOKENIZE);
+    vector<string> words;
+    forEachToken(emailText, length, [&](const string& word, size_t, size_t) { words.push_back(word); });
+    return words;
+}
+
+vector<string> tokenizeEmail(const char* emailText) {
+    return tokenizeEmail(emailText, strlen(emailText));
+}
+
+// Streaming HTML-to-text filter: drops tags, comments, <script> and <style>
+// bodies and decodes entities. Block-level tags become a space; inline tags
+// vanish so words split by markup ("fr<b>e</b>e") stay whole.
+class HtmlTextFilter {
+private:
+    enum State { TEXT, TAG, COMMENT, ENTITY, RAW_TEXT };
+    State state = TEXT;
+    string tagName;      // lowercased name of the tag being read
+    bool tagNameDone = false;
+    string entity;
+    string rawEnd;       // closing tag that ends RAW_TEXT, e.g. "</script"
+    size_t rawMatched = 0;
+    size_t commentDashes = 0;
+
+    static bool isInlineTag(const string& name) {
+        static const char* inlineTags[] = {"a", "b", "i", "u", "s", "em", "strong", "span", "font", "small",
+                                           "big", "sub", "sup", "tt", "abbr", "code", "mark", "wbr", "o:p"};
+        string bare = !name.empty() && name[0] == '/' ? name.substr(1) : name;
+        for (const char* tag : inlineTags)
+            if (bare == tag) return true;
+        return false;
+    }
+
+    void decodeEntity(string& out) {
+        static const pair<const char*, uint32_t> named[] = {
+            {"amp", '&'}, {"lt", '<'}, {"gt", '>'}, {"quot", '"'}, {"apos", '\''}, {"nbsp", ' '},
+            {"copy", 0xA9}, {"reg", 0xAE}, {"euro", 0x20AC}, {"pound", 0xA3}, {"shy", 0},
+            {"zwnj", 0}, {"zwj", 0}, {"ndash", 0x2013}, {"mdash", 0x2014}, {"hellip", 0x2026},
+        };
+        uint32_t cp = 0xFFFFFFFF;
+        if (entity.size() > 1 && entity[0] == '#') {
+            bool hex = entity[1] == 'x' || entity[1] == 'X';
+            cp = strtoul(entity.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10);
+            if (cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) cp = ' ';
+        } else {
+            for (const auto& e : named)
+                if (entity == e.first) cp = e.second;
+        }
+        if (cp == 0xFFFFFFFF) {
+            out += '&';
+            out += entity;
+        } else if (cp > 0 && cp < 0x80) {
+            out += (char)cp;
+        } else if (cp >= 0x80) {
+            appendUtf8(out, cp);
+        }
+        // Zero-width entities (&shy; &zwj;) are dropped so they cannot split words
+    }
+
+public:
+    void feed(const char* data, size_t len, string& out) {
+        for (size_t i = 0; i < len; ++i) {
+            char c = data[i];
+            switch (state) {
+            case TEXT:
+                if (c == '<') {
+                    state = TAG;
+                    tagName.clear();
+                    tagNameDone = false;
+                } else if (c == '&') {
+                    state = ENTITY;
+                    entity.clear();
+                } else {
+                    out += c;
+                }
+                break;
+            case ENTITY:
+                if (c == ';' || entity.size() >= 10 || !(isalnum((unsigned char)c) || c == '#')) {
+                    decodeEntity(out);
+                    state = TEXT;
+                    if (c != ';') --i; // reprocess the terminating character
+                } else {
+                    entity += c;
+                }
+                break;
+            case TAG:
+                if (c == '>') {
+                    state = TEXT;
+                    if (!isInlineTag(tagName)) out += ' ';
+                    if (tagName == "script" || tagName == "style") {
+                        state = RAW_TEXT;
+                        rawEnd = "</" + tagName;
+                        rawMatched = 0;
+                    }
+                } else if (!tagNameDone) {
+                    if (isspace((unsigned char)c) || c == '/') {
+                        tagNameDone = !tagName.empty();
+                        if (c == '/' && tagName.empty()) tagName += c;
+                    } else {
+                        tagName += (char)tolower((unsigned char)c);
+                        if (tagName == "!--") {
+                            state = COMMENT;
+                            commentDashes = 0;
+                        }
+                    }
+                }
+                break;
+            case COMMENT:
+                if (c == '>' && commentDashes >= 2) {
+                    state = TEXT;
+                    out += ' ';
+                }
+                commentDashes = c == '-' ? commentDashes + 1 : 0;
+                break;
+            case RAW_TEXT:
+                rawMatched = tolower((unsigned char)c) == rawEnd[rawMatched] ? rawMatched + 1 : (c == '<' ? 1 : 0);
+                if (rawMatched == rawEnd.size()) {
+                    state = TAG;
+                    tagName = "/";
+                    tagNameDone = true;
+                }
+                break;
+            }
+        }
+    }
+
+    // End of the HTML: an entity still being read ("AT&T", "&amp") is written out
+    void finish(string& out) {
+        if (state == ENTITY) decodeEntity(out);
+        state = TEXT;
+    }
+};
+
+// Streaming MIME preprocessor. Raw message bytes are fed in chunks of any size
+// and only human-readable text comes out: the Subject header and text/plain and
+// text/html parts, after undoing quoted-printable or base64 and stripping HTML.
+// Non-text parts (attachments, images) are skipped without decoding or
+// buffering, so their size barely affects the cost of a message. Input that
+// does not start with a header block is passed through as plain text.
+class MimeTextExtractor {
+private:
+    static constexpr size_t MAX_LINE_BYTES = 64 * 1024;
+    static constexpr size_t SKIPPED_LINE_BYTES = 128; // enough to recognize a boundary
+    static constexpr size_t MAX_DETECT_LINES = 1000;   // header lines buffered before deciding
+
+    enum Mode { DETECT, HEADERS, PREAMBLE, TEXT_BODY, SKIP_BODY };
+    enum Encoding { ENC_PLAIN, ENC_QUOTED_PRINTABLE, ENC_BASE64 };
+
+    struct PartHeaders {
+        string contentType = "text/plain";
+        string boundary;
+        Encoding encoding = ENC_PLAIN;
+        bool attachment = false;
+    };
+
+    string out;
+    string line;
+    bool lineContinues = false; // the buffered line is the tail of an over-long line
+    Mode mode = DETECT;
+    string headerLine;           // current (unfolded) header
+    PartHeaders part;
+    vector<string> boundaries;
+    bool html = false;
+    Encoding encoding = ENC_PLAIN;
+    HtmlTextFilter htmlFilter;
+    uint32_t base64Bits = 0;
+    int base64Count = 0;
+    string decoded;
+    vector<string> detectLines; // leading lines held back until the input's kind is known
+
+    void emit(const char* data, size_t len) {
+        if (html) htmlFilter.feed(data, len, out);
+        else out.append(data, len);
+    }
+
+    static string lowerCopy(const string& text) {
+        string result = text;
+        for (char& c : result) c = tolower((unsigned char)c);
+        return result;
+    }
+
+    // Value of name=... within a header such as Content-Type
+    static string headerParameter(const string& header, const string& name) {
+        string lower = lowerCopy(header);
+        for (size_t pos = lower.find(name + "="); pos != string::npos; pos = lower.find(name + "=", pos + 1)) {
+            if (pos > 0 && (isalnum((unsigned char)lower[pos - 1]) || lower[pos - 1] == '-')) continue;
+            size_t start = pos + name.size() + 1;
+            if (start < header.size() && header[start] == '"') {
+                size_t end = header.find('"', start + 1);
+                return header.substr(start + 1, end == string::npos ? string::npos : end - start - 1);
+            }
+            size_t end = header.find_first_of("; \t", start);
+            return header.substr(start, end == string::npos ? string::npos : end - start);
+        }
+        return "";
+    }
+
+    void applyHeader(const string& header) {
+        size_t colon = header.find(':');
+        if (colon == string::npos) return;
+        string name = lowerCopy(header.substr(0, colon));
+        string value = header.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+
+        if (name == "content-type") {
+            string type = lowerCopy(value.substr(0, value.find(';')));
+            type.erase(type.find_last_not_of(" \t") + 1);
+            part.contentType = type;
+            part.boundary = headerParameter(value, "boundary");
+        } else if (name == "content-transfer-encoding") {
+            string enc = lowerCopy(value);
+            part.encoding = enc.compare(0, 6, "base64") == 0 ? ENC_BASE64
+                          : enc.compare(0, 16, "quoted-printable") == 0 ? ENC_QUOTED_PRINTABLE : ENC_PLAIN;
+        } else if (name == "content-disposition") {
+            part.attachment = lowerCopy(value).compare(0, 10, "attachment") == 0;
+        } else if (name == "subject" && boundaries.empty()) {
+            out += value;
+            out += '\n';
+        }
+    }
+
+    void endHeaders() {
+        if (!headerLine.empty()) applyHeader(headerLine);
+        headerLine.clear();
+        bool isText = part.contentType.compare(0, 5, "text/") == 0;
+        if (part.contentType.compare(0, 10, "multipart/") == 0 && !part.boundary.empty()) {
+            boundaries.push_back(part.boundary);
+            mode = PREAMBLE;
+        } else if (part.contentType == "message/rfc822") {
+            part = PartHeaders();
+            mode = HEADERS;
+        } else if (isText && !(part.attachment && part.contentType != "text/plain" && part.contentType != "text/html")) {
+            startTextBody(part.encoding, part.contentType == "text/html");
+        } else {
+            mode = SKIP_BODY;
+        }
+    }
+
+    // The current text part is over; flush what the HTML filter still holds
+    void endTextBody() {
+        if (mode == TEXT_BODY && html) htmlFilter.finish(out);
+    }
+
+    void startTextBody(Encoding enc, bool isHtml) {
+        mode = TEXT_BODY;
+        encoding = enc;
+        html = isHtml;
+        htmlFilter = HtmlTextFilter();
+        base64Bits = 0;
+        base64Count = 0;
+        if (!out.empty() && out.back() != '\n') out += '\n';
+    }
+
+    // "--boundary" or "--boundary--" for any enclosing multipart; returns the depth matched
+    int matchBoundary(const string& text, bool& closing) const {
+        if (text.size() < 3 || text[0] != '-' || text[1] != '-') return -1;
+        for (int d = (int)boundaries.size() - 1; d >= 0; --d) {
+            const string& b = boundaries[d];
+            if (text.compare(2, b.size(), b) != 0) continue;
+            closing = text.compare(2 + b.size(), 2, "--") == 0;
+            return d;
+        }
+        return -1;
+    }
+
+    void decodeBody(const char* data, size_t len, bool endOfLine) {
+        if (encoding == ENC_BASE64) {
+            static const string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            decoded.clear();
+            for (size_t i = 0; i < len; ++i) {
+                size_t v = alphabet.find(data[i]);
+                if (v == string::npos) continue;
+                base64Bits = (base64Bits << 6) | (uint32_t)v;
+                if (++base64Count == 4) {
+                    decoded += (char)(base64Bits >> 16);
+                    decoded += (char)(base64Bits >> 8);
+                    decoded += (char)base64Bits;
+                    base64Bits = 0;
+                    base64Count = 0;
+                }
+            }
+            // A short final quantum (before '=' padding) still carries whole bytes
+            if (len > 0 && data[len - 1] == '=' && base64Count > 1) {
+                base64Bits <<= 6 * (4 - base64Count);
+                decoded += (char)(base64Bits >> 16);
+                if (base64Count == 3) decoded += (char)(base64Bits >> 8);
+                base64Bits = 0;
+                base64Count = 0;
+            }
+            emit(decoded.data(), decoded.size());
+            return;
+        }
+        if (encoding == ENC_QUOTED_PRINTABLE) {
+            decoded.clear();
+            bool softBreak = endOfLine && len > 0 && data[len - 1] == '=';
+            size_t end = softBreak ? len - 1 : len;
+            for (size_t i = 0; i < end; ++i) {
+                if (data[i] == '=' && i + 2 < end && isxdigit((unsigned char)data[i + 1]) &&
+                    isxdigit((unsigned char)data[i + 2])) {
+                    decoded += (char)stoi(string(data + i + 1, 2), nullptr, 16);
+                    i += 2;
+                } else {
+                    decoded += data[i];
+                }
+            }
+            if (endOfLine && !softBreak) decoded += '\n';
+            emit(decoded.data(), decoded.size());
+            return;
+        }
+        emit(data, len);
+        if (endOfLine) emit("\n", 1);
+    }
+
+    // Length of the "Name" in a "Name: value" line, or 0
+    static size_t headerNameLength(const string& text) {
+        size_t colon = text.find(':');
+        if (colon == string::npos || colon == 0) return 0;
+        bool name = all_of(text.begin(), text.begin() + colon, [](char c) { return isalnum((unsigned char)c) || c == '-'; });
+        return name ? colon : 0;
+    }
+
+    // The held-back lines form a message header: "Name: value" and folded
+    // lines only, after an optional mbox "From " line, naming at least one
+    // standard header. Pasted text such as "Note: ..." or "http://..." doesn't.
+    bool detectedHeaderBlock() const {
+        static const char* const KNOWN[] = {"from", "to", "cc", "subject", "date", "received", "return-path",
+                                            "message-id", "mime-version", "content-type", "reply-to", "sender",
+                                            "delivered-to"};
+        bool known = false;
+        for (const string& text : detectLines) {
+            size_t length = headerNameLength(text);
+            if (!length) continue;
+            string name = lowerCopy(text.substr(0, length));
+            for (const char* header : KNOWN) known = known || name == header;
+        }
+        return known;
+    }
+
+    // Leave DETECT as a message or as plain text and replay the held-back lines
+    void resolveDetect(bool message) {
+        vector<string> held;
+        held.swap(detectLines);
+        string current;
+        current.swap(line);
+        if (message) mode = HEADERS;
+        else startTextBody(ENC_PLAIN, false);
+        for (size_t i = 0; i < held.size(); ++i) {
+            if (message && i == 0 && held[i].compare(0, 5, "From ") == 0) continue;
+            line.swap(held[i]);
+            processLine(true);
+        }
+        line.swap(current);
+    }
+
+    void processLine(bool endOfLine) {
+        if (endOfLine && !line.empty() && line.back() == '\r') line.pop_back();
+
+        if (mode == DETECT) {
+            // Hold lines back while they could still be a header block
+            bool folded = !line.empty() && (line[0] == ' ' || line[0] == '\t');
+            bool headerShaped = endOfLine && (headerNameLength(line) > 0 || (folded && !detectLines.empty()) ||
+                                              (detectLines.empty() && line.compare(0, 5, "From ") == 0));
+            if (headerShaped && detectLines.size() < MAX_DETECT_LINES) {
+                detectLines.push_back(line);
+                return;
+            }
+            // A blank line (or the line cap) ends a block of header-shaped lines
+            resolveDetect((line.empty() || headerShaped) && detectedHeaderBlock());
+            if (headerShaped) {
+                processLine(true);
+                return;
+            }
+        }
+
+        if (!lineContinues && !boundaries.empty() && mode != HEADERS) {
+            bool closing = false;
+            int depth = matchBoundary(line, closing);
+            if (depth >= 0) {
+                endTextBody();
+                boundaries.resize(depth + 1);
+                if (closing) {
+                    boundaries.pop_back();
+                    mode = SKIP_BODY; // epilogue
+                } else {
+                    part = PartHeaders();
+                    mode = HEADERS;
+                }
+                return;
+            }
+        }
+
+        switch (mode) {
+        case HEADERS:
+            if (line.empty() && endOfLine) {
+                endHeaders();
+            } else if (!line.empty() && (line[0] == ' ' || line[0] == '\t') && !headerLine.empty()) {
+                if (headerLine.size() < MAX_LINE_BYTES) headerLine += " " + line.substr(line.find_first_not_of(" \t"));
+            } else {
+                if (!headerLine.empty()) applyHeader(headerLine);
+                headerLine = line;
+            }
+            break;
+        case TEXT_BODY:
+            decodeBody(line.data(), line.size(), endOfLine);
+            break;
+        default:
+            break;
+        }
+    }
+
+public:
+    void feed(const char* data, size_t len) {
+        PhaseTimer timer(PHASE_PREPROCESS);
+        while (len > 0) {
+            const char* newline = static_cast<const char*>(memchr(data, '\n', len));
+            size_t take = newline ? newline - data + 1 : len;
+            size_t content = newline ? take - 1 : take;
+
+            if (mode == SKIP_BODY || mode == PREAMBLE) {
+                // Only the start of a line matters in skipped parts
+                if (line.size() < SKIPPED_LINE_BYTES)
+                    line.append(data, min(content, SKIPPED_LINE_BYTES - line.size()));
+            } else {
+                line.append(data, content);
+                if (!newline && line.size() >= MAX_LINE_BYTES) {
+                    processLine(false);
+                    line.clear();
+                    lineContinues = true;
+                }
+            }
+            if (newline) {
+                processLine(true);
+                line.clear();
+                lineContinues = false;
+            }
+            data += take;
+            len -= take;
+        }
+    }
+
+    // Flush the last unterminated line and return the extracted text
+    string finish() {
+        if (!line.empty()) processLine(true);
+        line.clear();
+        if (mode == DETECT) resolveDetect(detectedHeaderBlock());
+        if (mode == HEADERS) endHeaders();
+        endTextBody();
+        return move(out);
+    }
+};
+
+// Text of a raw message as the classifier should see it
+string extractMessageText(const string& rawMessage) {
+    MimeTextExtractor extractor;
+    extractor.feed(rawMessage.data(), rawMessage.size());
+    return extractor.finish();
+}
+
+// Byte windows of a text that fit budget.maxBytes (the whole text when it fits),
+// trimmed to whitespace so no token or UTF-8 sequence is cut
+vector<pair<size_t, size_t>> budgetWindows(const char* text, size_t length, const MessageBudget& budget) {
+    if (length <= budget.maxBytes) return {{0, length}};
+    auto isSpace = [](char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r'; };
+    vector<pair<size_t, size_t>> windows;
+    for (const auto& range : sampleRanges(length, budget.maxBytes)) {
+        size_t begin = range.first, end = range.second;
+        if (begin > 0 && !isSpace(text[begin - 1]))
+            while (begin < end && !isSpace(text[begin])) ++begin;
+        if (end < length && !isSpace(text[end]))
+            while (end > begin && !isSpace(text[end - 1])) --end;
+        windows.push_back({begin, end});
+    }
+    return windows;
+}
+
+// Tokenize at most budget.maxBytes of text and keep at most budget.maxTokens
+// tokens, sampling head, tail and middle once either limit is exceeded
+vector<string> tokenizeWithinBudget(const char* text, size_t length, const MessageBudget& budget, bool& sampled) {
+    sampled = length > budget.maxBytes;
+    vector<string> words;
+    for (const auto& window : budgetWindows(text, length, budget)) {
+        vector<string> windowWords = tokenizeEmail(text + window.first, window.second - window.first);
+        if (words.empty()) words.swap(windowWords);
+        else words.insert(words.end(), make_move_iterator(windowWords.begin()), make_move_iterator(windowWords.end()));
+    }
+
+    if (words.size() > budget.maxTokens) {
+        sampled = true;
+        vector<string> kept;
+        kept.reserve(budget.maxTokens);
+        for (const auto& range : sampleRanges(words.size(), budget.maxTokens))
+            for (size_t i = range.first; i < range.second; ++i) kept.push_back(move(words[i]));
+        words.swap(kept);
+    }
+    return words;
+}
+
+// Utility to split CSV lines
+vector<string> splitCSVLine(const string& line) {
+    vector<string> tokens;
+    stringstream ss(line);
+    string token;
+
+    while (getline(ss, token, ',')) {
+        if (!token.empty() && token.front() == '"' && token.back() == '"') {
+            token = token.substr(1, token.length() - 2);
+        }
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+// Load word frequencies from CSV
+void loadWordFrequenciesFromTransposedCSV(const string& filename, HashMap* chainMap, HashMap* openMap, vector<string>& wordsOrder) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        cerr << "Error opening file: " << filename << endl;
+        return;
+    }
+
+    string wordsLine, spamLine, hamLine;
+    getline(file, wordsLine);
+    getline(file, spamLine);
+    getline(file, hamLine);
+
+    vector<string> words = splitCSVLine(wordsLine);
+    vector<string> spamCounts = splitCSVLine(spamLine);
+    vector<string> hamCounts = splitCSVLine(hamLine);
+
+    if (spamCounts.size() != words.size() || hamCounts.size() != words.size()) {
+        cerr << "Error: Inconsistent number of columns in CSV file" << endl;
+        return;
+    }
+
+    for (size_t i = 0; i < words.size(); ++i) {
+        if (words[i].empty() || words[i] == "Word" || words[i] == "word") continue;
+
+        try {
+            double spamFreq = stod(spamCounts[i]);
+            double hamFreq = stod(hamCounts[i]);
+            WordFreq wordFreq(words[i], spamFreq, hamFreq);
+            chainMap->insert(wordFreq);
+            openMap->insert(wordFreq);
+            wordsOrder.push_back(words[i]);
+        } catch (...) {
+            cerr << "Error processing column " << i + 1 << ": " << words[i] << endl;
+        }
+    }
+
+    file.close();
+}
+
+// Write a word list in the transposed CSV layout (words, spam counts, ham
+// counts). The file is replaced atomically; beforeRename receives its stamp.
+bool writeWordFrequenciesToTransposedCSV(const string& filename, const vector<WordFreq>& words,
+                                         const StampListener& beforeRename = nullptr) {
+    AtomicFileWriter file(filename);
+    for (size_t i = 0; i < words.size(); ++i) {
+        if (i > 0) file.append(',');
+        file.append('"');
+        file.append(words[i].word);
+        file.append('"');
+    }
+    file.append('\n');
+
+    for (size_t i = 0; i < words.size(); ++i) {
+        if (i > 0) file.append(',');
+        file.appendNumber(words[i].spamFreq);
+    }
+    file.append('\n');
+
+    for (size_t i = 0; i < words.size(); ++i) {
+        if (i > 0) file.append(',');
+        file.appendNumber(words[i].hamFreq);
+    }
+    file.append('\n');
+
+    return file.commit(beforeRename);
+}
+
+// Binary model: "SPMB", uint32 version, uint64 count, then per word
+// uint32 length, bytes, double spamFreq, double hamFreq (host byte order)
+const char BINARY_MODEL_MAGIC[4] = {'S', 'P', 'M', 'B'};
+const uint32_t BINARY_MODEL_VERSION = 1;
+
+bool writeWordFrequenciesToBinary(const string& filename, const vector<WordFreq>& words,
+                                  const StampListener& beforeRename = nullptr) {
+    AtomicFileWriter file(filename);
+    uint64_t count = words.size();
+    file.append(BINARY_MODEL_MAGIC, 4);
+    file.appendRaw(BINARY_MODEL_VERSION);
+    file.appendRaw(count);
+    for (const WordFreq& wf : words) {
+        uint32_t length = wf.word.size();
+        file.appendRaw(length);
+        file.append(wf.word);
+        file.appendRaw(wf.spamFreq);
+        file.appendRaw(wf.hamFreq);
+    }
+    return file.commit(beforeRename);
+}
+
+// Visit every entry of a binary model; false if the file is unreadable or truncated
+bool readBinaryModel(const string& filename, const function<void(const WordFreq&)>& onWord) {
+    ifstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error opening file: " << filename << endl;
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version = 0;
+    uint64_t count = 0;
+    file.read(magic, 4);
+    file.read(reinterpret_cast<char*>(&version), sizeof(version));
+    file.read(reinterpret_cast<char*>(&count), sizeof(count));
+    if (!file || memcmp(magic, BINARY_MODEL_MAGIC, 4) != 0 || version != BINARY_MODEL_VERSION) {
+        cerr << "Error: " << filename << " is not a binary model file" << endl;
+        return false;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t length = 0;
+        WordFreq wordFreq;
+        file.read(reinterpret_cast<char*>(&length), sizeof(length));
+        wordFreq.word.resize(length);
+        file.read(&wordFreq.word[0], length);
+        file.read(reinterpret_cast<char*>(&wordFreq.spamFreq), sizeof(wordFreq.spamFreq));
+        file.read(reinterpret_cast<char*>(&wordFreq.hamFreq), sizeof(wordFreq.hamFreq));
+        if (!file) {
+            cerr << "Error: truncated binary model at entry " << i + 1 << endl;
+            return false;
+        }
+        onWord(wordFreq);
+    }
+    return true;
+}
+
+void loadWordFrequenciesFromBinary(const string& filename, HashMap* chainMap, HashMap* openMap, vector<string>& wordsOrder) {
+    readBinaryModel(filename, [&](const WordFreq& wordFreq) {
+        chainMap->insert(wordFreq);
+        openMap->insert(wordFreq);
+        wordsOrder.push_back(wordFreq.word);
+    });
+}
+
+bool isBinaryModelFile(const string& filename) {
+    ifstream file(filename, ios::binary);
+    char magic[4] = {};
+    file.read(magic, 4);
+    return file.gcount() == 4 && memcmp(magic, BINARY_MODEL_MAGIC, 4) == 0;
+}
+
+// Load a model in either format, detected from the file's magic bytes
+void loadWordFrequencies(const string& filename, HashMap* chainMap, HashMap* openMap, vector<string>& wordsOrder) {
+    if (isBinaryModelFile(filename)) {
+        loadWordFrequenciesFromBinary(filename, chainMap, openMap, wordsOrder);
+    } else {
+        loadWordFrequenciesFromTransposedCSV(filename, chainMap, openMap, wordsOrder);
+    }
+}
+
+// Streams (word, spam, ham) columns out of a transposed CSV without loading whole
+// rows: three cursors on the same file advance through the three rows in lockstep
+class TransposedCSVReader {
+private:
+    ifstream rows[3];
+    size_t column = 0;
+    bool ok = false;
+    bool malformed = false;
+
+    // Read one comma-separated field; returns false at end of row
+    static bool readField(istream& in, string& field) {
+        field.clear();
+        int c;
+        while ((c = in.get()) != EOF && c != ',' && c != '\n') {
+            if (c != '\r') field += (char)c;
+        }
+        if (c == EOF && field.empty()) return false;
+        if (c == '\n' || c == EOF) in.setstate(ios::eofbit);
+        if (field.size() >= 2 && field.front() == '"' && field.back() == '"')
+            field = field.substr(1, field.size() - 2);
+        return true;
+    }
+
+public:
+    explicit TransposedCSVReader(const string& filename) {
+        for (int r = 0; r < 3; ++r) {
+            rows[r].open(filename);
+            if (!rows[r].is_open()) return;
+            for (int skip = 0; skip < r; ++skip)
+                rows[r].ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+        ok = true;
+    }
+
+    bool isOpen() const { return ok; }
+    // The rows disagree on the number of columns; next() stopped early
+    bool isMalformed() const { return malformed; }
+
+    // Next column of the model; returns false at the end of the words row or
+    // on a malformed file (see isMalformed)
+    bool next(WordFreq& out) {
+        string word, spamField, hamField;
+        while (ok) {
+            bool haveWord = !rows[0].eof() && readField(rows[0], word);
+            bool haveSpam = !rows[1].eof() && readField(rows[1], spamField);
+            bool haveHam = !rows[2].eof() && readField(rows[2], hamField);
+            if (!haveWord) return false;
+            column++;
+            if (!haveSpam || !haveHam) {
+                cerr << "Error: Inconsistent number of columns at column " << column << endl;
+                ok = false;
+                malformed = true;
+                return false;
+            }
+            if (word.empty() || word == "Word" || word == "word") continue;
+            try {
+                out = WordFreq(word, stod(spamField), stod(hamField));
+                return true;
+            } catch (...) {
+                cerr << "Error processing column " << column << ": " << word << endl;
+            }
+        }
+        return false;
+    }
+};
+
+// Writes a transposed CSV one column at a time: each row goes to its own temp
+// file and the rows are concatenated into place on finish()
+class TransposedCSVWriter {
+private:
+    string filename;
+    ofstream rows[3];
+    size_t columns = 0;
+
+    string rowFile(int r) const { return filename + ".row" + to_string(r) + ".tmp"; }
+
+public:
+    explicit TransposedCSVWriter(const string& file) : filename(file) {
+        for (int r = 0; r < 3; ++r) {
+            rows[r].open(rowFile(r));
+            rows[r] << setprecision(15);
+        }
+    }
+
+    // Drops the row files of a writer that was never finished
+    ~TransposedCSVWriter() {
+        for (int r = 0; r < 3; ++r) {
+            if (!rows[r].is_open()) continue;
+            rows[r].close();
+            remove(rowFile(r).c_str());
+        }
+    }
+
+    bool isOpen() const { return rows[0].is_open() && rows[1].is_open() && rows[2].is_open(); }
+
+    void write(const WordFreq& wf) {
+        const char* sep = columns++ > 0 ? "," : "";
+        rows[0] << sep << "\"" << wf.word << "\"";
+        rows[1] << sep << wf.spamFreq;
+        rows[2] << sep << wf.hamFreq;
+    }
+
+    bool finish() {
+        bool ok = true;
+        for (int r = 0; r < 3; ++r) {
+            rows[r] << "\n";
+            rows[r].close();
+            ok = ok && !rows[r].fail();
+        }
+        {
+            AtomicFileWriter out(filename);
+            vector<char> chunk(1 << 20);
+            for (int r = 0; r < 3 && ok; ++r) {
+                ifstream in(rowFile(r), ios::binary);
+                while (in.read(chunk.data(), chunk.size()) || in.gcount() > 0) out.append(chunk.data(), in.gcount());
+                ok = !in.bad();
+            }
+            ok = ok && out.commit();
+        }
+        for (int r = 0; r < 3; ++r) remove(rowFile(r).c_str());
+        if (!ok) cerr << "Error writing file: " << filename << endl;
+        return ok;
+    }
+};
+
+// One input of a model merge
+struct ModelShard {
+    string path;
+    double weight = 1.0;
+};
+
+// Returns true when the shard's words are in strictly ascending order. An
+// unreadable or malformed shard is not sorted, so writeSortedShard reports it.
+bool isShardSorted(const string& filename) {
+    TransposedCSVReader reader(filename);
+    WordFreq prev, wf;
+    bool first = true;
+    while (reader.next(wf)) {
+        if (!first && !(prev.word < wf.word)) return false;
+        prev = wf;
+        first = false;
+    }
+    return reader.isOpen();
+}
+
+// Write a word-sorted copy of a shard; needs memory for this one shard only
+bool writeSortedShard(const string& filename, const string& sortedFile) {
+    TransposedCSVReader reader(filename);
+    if (!reader.isOpen()) {
+        cerr << "Error opening file: " << filename << endl;
+        return false;
+    }
+    vector<WordFreq> words;
+    WordFreq wf;
+    while (reader.next(wf)) words.push_back(wf);
+    if (reader.isMalformed()) {
+        cerr << "Malformed shard: " << filename << endl;
+        return false;
+    }
+    sort(words.begin(), words.end(), [](const WordFreq& a, const WordFreq& b) { return a.word < b.word; });
+
+    TransposedCSVWriter writer(sortedFile);
+    if (!writer.isOpen()) return false;
+    for (size_t i = 0; i < words.size(); ++i) {
+        // Duplicate columns within a shard are summed
+        if (i + 1 < words.size() && words[i + 1].word == words[i].word) {
+            words[i + 1].spamFreq += words[i].spamFreq;
+            words[i + 1].hamFreq += words[i].hamFreq;
+            continue;
+        }
+        writer.write(words[i]);
+    }
+    return writer.finish();
+}
+
+// Sum spamFreq/hamFreq per word over N shards with a streaming k-way merge. Each
+// shard is scaled by its weight and, when halfLifeDays > 0, by 0.5^(age / halfLife)
+// using the file's modification time. Unsorted shards are sorted into a temp file
+// first, so memory is bounded by the largest unsorted shard, not the total
+// vocabulary. The output is sorted by word.
+bool mergeModelShards(const vector<ModelShard>& shards, const string& outFile, double halfLifeDays = 0.0) {
+    vector<string> inputs;
+    vector<string> tempFiles;
+    vector<double> weights;
+    auto now = filesystem::file_time_type::clock::now();
+    auto fail = [&]() {
+        for (const string& tmp : tempFiles) remove(tmp.c_str());
+        return false;
+    };
+
+    for (size_t i = 0; i < shards.size(); ++i) {
+        error_code ec;
+        auto modified = filesystem::last_write_time(shards[i].path, ec);
+        if (ec) {
+            cerr << "Error opening file: " << shards[i].path << endl;
+            return fail();
+        }
+        double weight = shards[i].weight;
+        if (halfLifeDays > 0) {
+            double ageDays = chrono::duration<double>(now - modified).count() / 86400.0;
+            weight *= pow(0.5, max(0.0, ageDays) / halfLifeDays);
+        }
+        weights.push_back(weight);
+
+        if (isShardSorted(shards[i].path)) {
+            inputs.push_back(shards[i].path);
+        } else {
+            string sortedFile = outFile + ".shard" + to_string(i) + ".sorted.tmp";
+            tempFiles.push_back(sortedFile);
+            if (!writeSortedShard(shards[i].path, sortedFile)) return fail();
+            inputs.push_back(sortedFile);
+        }
+    }
+
+    vector<unique_ptr<TransposedCSVReader>> readers;
+    vector<WordFreq> heads(inputs.size());
+    typedef pair<string, size_t> HeapEntry;
+    priority_queue<HeapEntry, vector<HeapEntry>, greater<HeapEntry>> heap;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        readers.emplace_back(new TransposedCSVReader(inputs[i]));
+        if (!readers[i]->isOpen()) {
+            cerr << "Error opening file: " << inputs[i] << endl;
+            return fail();
+        }
+        if (readers[i]->next(heads[i])) heap.push({heads[i].word, i});
+    }
+
+    TransposedCSVWriter writer(outFile);
+    if (!writer.isOpen()) {
+        cerr << "Error opening file for writing: " << outFile << endl;
+        return fail();
+    }
+    while (!heap.empty()) {
+        WordFreq merged(heap.top().first);
+        while (!heap.empty() && heap.top().first == merged.word) {
+            size_t i = heap.top().second;
+            heap.pop();
+            merged.spamFreq += heads[i].spamFreq * weights[i];
+            merged.hamFreq += heads[i].hamFreq * weights[i];
+            if (readers[i]->next(heads[i])) heap.push({heads[i].word, i});
+        }
+        writer.write(merged);
+    }
+    // A shard that went bad mid-merge would leave the output truncated
+    for (size_t i = 0; i < readers.size(); ++i) {
+        if (readers[i]->isMalformed()) {
+            cerr << "Malformed shard: " << inputs[i] << endl;
+            return fail();
+        }
+    }
+    bool ok = writer.finish();
+
+    for (const string& tmp : tempFiles) remove(tmp.c_str());
+    return ok;
+}
+
+// Count-min sketch over token strings: DEPTH rows of 32-bit counters with
+// conservative update. Counters are halved every `width` additions so tokens
+// must recur within a recent window to keep their estimate.
+class CountMinSketch {
+private:
+    static const int DEPTH = 4;
+    size_t width;
+    vector<uint32_t> counters;
+    size_t additions = 0;
+
+    void indexes(const string& key, size_t out[DEPTH]) const {
+        uint64_t h = wyhash64(key.data(), key.size(), 0x5ce7c4u);
+        uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+        for (int d = 0; d < DEPTH; ++d)
+            out[d] = d * width + ((h1 + d * h2) & (width - 1));
+    }
+
+public:
+    // width is rounded up to a power of two
+    CountMinSketch(size_t w = 1 << 15) : width(1) {
+        while (width < w) width <<= 1;
+        counters.assign(DEPTH * width, 0);
+    }
+
+    uint32_t estimate(const string& key) const {
+        size_t idx[DEPTH];
+        indexes(key, idx);
+        uint32_t best = UINT32_MAX;
+        for (int d = 0; d < DEPTH; ++d) best = min(best, counters[idx[d]]);
+        return best;
+    }
+
+    // Add one sighting and return the new estimate
+    uint32_t add(const string& key) {
+        size_t idx[DEPTH];
+        indexes(key, idx);
+        uint32_t best = UINT32_MAX;
+        for (int d = 0; d < DEPTH; ++d) best = min(best, counters[idx[d]]);
+        for (int d = 0; d < DEPTH; ++d)
+            if (counters[idx[d]] == best) counters[idx[d]]++;
+
+        if (++additions >= width) {
+            for (uint32_t& c : counters) c >>= 1;
+            additions = 0;
+        }
+        return best + 1;
+    }
+
+    size_t memoryUsage() const { return counters.capacity() * sizeof(uint32_t); }
+};
+
+// Bounds on how far feedback can grow the vocabulary
+struct VocabularyBudget {
+    size_t maxWords = 200000;   // feedback stops growing the vocabulary past this (SPAM_MAX_WORDS)
+    uint32_t admitAfter = 2;    // messages an unseen token must appear in before it is added
+    double pruneTo = 0.9;       // fraction of maxWords kept after a pruning pass
+    size_t maxUserWords = 20000; // cap on one user's personal delta (SPAM_MAX_USER_WORDS)
+};
+
+// Evidence a word carries: its spam/ham count difference. Rare words and words
+// with a spam share near 0.5 score lowest.
+double wordInformation(const WordFreq& wf) {
+    return fabs(wf.spamFreq - wf.hamFreq);
+}
+
+// Drop the least informative words until at most targetWords remain. Only
+// wordsOrder[firstPrunable...] may go, so words read from the model file are
+// kept whatever their evidence. Each map is cleaned in one pass. Returns the
+// number of words removed.
+size_t pruneVocabulary(HashMap* chainMap, HashMap* openMap, vector<string>& wordsOrder, size_t targetWords,
+                       size_t firstPrunable = 0) {
+    if ((size_t)chainMap->getCount() <= targetWords || firstPrunable >= wordsOrder.size()) return 0;
+
+    // Rank candidates by (information, total) and evict the lowest
+    typedef pair<double, double> Rank;
+    vector<pair<Rank, size_t>> candidates;
+    for (size_t i = firstPrunable; i < wordsOrder.size(); ++i) {
+        WordFreq* wf = chainMap->search(wordsOrder[i]);
+        if (wf) candidates.push_back({Rank(wordInformation(*wf), wf->spamFreq + wf->hamFreq), i});
+    }
+    size_t toRemove = min(chainMap->getCount() - targetWords, candidates.size());
+    if (toRemove == 0) return 0;
+    nth_element(candidates.begin(), candidates.begin() + (toRemove - 1), candidates.end());
+    vector<string> doomed;
+    for (size_t i = 0; i < toRemove; ++i) doomed.push_back(wordsOrder[candidates[i].second]);
+    sort(doomed.begin(), doomed.end());
+    auto isDoomed = [&](const string& word) { return binary_search(doomed.begin(), doomed.end(), word); };
+
+    size_t removed = chainMap->eraseIf([&](const WordFreq& wf) { return isDoomed(wf.word); });
+    openMap->eraseIf([&](const WordFreq& wf) { return isDoomed(wf.word); });
+    wordsOrder.erase(remove_if(wordsOrder.begin(), wordsOrder.end(), isDoomed), wordsOrder.end());
+    return removed;
+}
+
+// One loaded version of the word-frequency model. Readers take a shared_ptr
+// to the current version, so a version replaced by a reload stays alive until
+// the last classification using it finishes. Feedback updates the current
+// version in place, on the GTK main thread only.
+struct SpamModel {
+    vector<string> wordsOrder;
+    ChainingHashMap chainMap;
+    OpenAddressingHashMap openMap;
+    uint64_t version = 0;
+    uint64_t vocabularyChanges = 0; // bumped whenever words are added or removed
+    size_t loadedWords = 0;         // leading wordsOrder entries read from the file; never pruned
+    CompressedTrie prefixIndex;     // words -> positions in wordsOrder, for prefix queries
+    uint64_t prefixIndexBuiltAt = UINT64_MAX;
+
+    // Prefix index over the current vocabulary, rebuilt after the vocabulary changed
+    const CompressedTrie& wordPrefixIndex() {
+        if (prefixIndexBuiltAt != vocabularyChanges) {
+            prefixIndex.build(wordsOrder);
+            prefixIndexBuiltAt = vocabularyChanges;
+        }
+        return prefixIndex;
+    }
+
+    SpamModel() {
+        // Report lookups on both maps under their own names
+        chainMap.setMetricsName("chaining");
+        openMap.setMetricsName("open_addressing");
+    }
+};
+
+// Prune the model back under budget once feedback grows it past maxWords.
+// Loading a model never prunes it, whatever its size.
+// Only words admitted by feedback are pruned: a model loaded above the budget
+// keeps all of its words and just stops growing.
+void enforceVocabularyBudget(SpamModel& model, const VocabularyBudget& budget) {
+    size_t words = model.chainMap.getCount();
+    if (words <= budget.maxWords || words <= model.loadedWords) return;
+    size_t target = max((size_t)(budget.maxWords * budget.pruneTo), model.loadedWords);
+    size_t removed = pruneVocabulary(&model.chainMap, &model.openMap, model.wordsOrder, target, model.loadedWords);
+    model.vocabularyChanges++;
+    cout << "Vocabulary over budget: pruned " << removed << " low-information words" << endl;
+}
+
+// Copy of a model's words and counts in file order, for saving
+vector<WordFreq> snapshotWords(SpamModel& model) {
+    vector<WordFreq> words;
+    words.reserve(model.wordsOrder.size());
+    for (const string& word : model.wordsOrder) {
+        WordFreq* wf = model.chainMap.search(word);
+        words.push_back(wf ? *wf : WordFreq(word));
+    }
+    return words;
+}
+
+bool writeModelFile(const string& filename, const vector<WordFreq>& words, bool binary,
+                    const StampListener& beforeRename = nullptr) {
+    PhaseTimer timer(PHASE_SAVE);
+    return binary ? writeWordFrequenciesToBinary(filename, words, beforeRename)
+                  : writeWordFrequenciesToTransposedCSV(filename, words, beforeRename);
+}
+
+// Load a model file and check it before it is used: returns nullptr if the
+// file is missing or empty, holds negative or non-finite counts, or changed
+// while it was being read (a writer still at work)
+shared_ptr<SpamModel> loadSpamModel(const string& filename, FileStamp* loadedStamp = nullptr) {
+    FileStamp before = statFile(filename);
+    if (!before.valid) {
+        cerr << "Model file not found: " << filename << endl;
+        return nullptr;
+    }
+
+    auto model = make_shared<SpamModel>();
+    loadWordFrequencies(filename, &model->chainMap, &model->openMap, model->wordsOrder);
+    if (statFile(filename) != before) {
+        cerr << "Model file changed while loading: " << filename << endl;
+        return nullptr;
+    }
+    if (model->wordsOrder.empty()) {
+        cerr << "Model file has no words: " << filename << endl;
+        return nullptr;
+    }
+    bool countsValid = true;
+    model->chainMap.forEach([&](const WordFreq& wf) {
+        if (!isfinite(wf.spamFreq) || !isfinite(wf.hamFreq) || wf.spamFreq < 0 || wf.hamFreq < 0) countsValid = false;
+    });
+    if (!countsValid) {
+        cerr << "Model file has invalid counts: " << filename << endl;
+        return nullptr;
+    }
+
+    model->loadedWords = model->wordsOrder.size();
+    if (loadedStamp) *loadedStamp = before;
+    return model;
+}
+
+// Labeled feedback collected before it touches the model. Token counts are
+// aggregated per distinct word (plus the number of messages each word was seen
+// in, which drives vocabulary admission) and hashed n-gram updates per table
+// slot, so applying a batch costs one update per distinct key, however many
+// messages or repeated tokens went into it.
+class FeedbackBatch {
+public:
+    struct WordDelta {
+        string word;
+        double spamFreq;
+        double hamFreq;
+        uint32_t spamMessages;
+        uint32_t hamMessages;
+    };
+
+private:
+    const FeatureHashedScorer& scorer;
+    SwissHashMap occurrences;  // per word: spam/ham token counts
+    SwissHashMap messageCounts; // per word: spam/ham messages containing it
+    vector<pair<uint64_t, uint32_t>> featureDeltas; // (slot << 1 | isSpam, count)
+    size_t compactedSize = 0;
+    size_t messages = 0;
+    vector<string> sorted;
+    vector<size_t> slots;
+
+    static void addTo(SwissHashMap& map, const string& word, bool isSpam, double amount) {
+        WordFreq* wf = map.search(word);
+        if (!wf) {
+            map.insert(WordFreq(word));
+            wf = map.search(word);
+        }
+        (isSpam ? wf->spamFreq : wf->hamFreq) += amount;
+    }
+
+    // Merge equal slots so pending n-gram updates stay bounded by distinct slots
+    void compactFeatures() {
+        sort(featureDeltas.begin(), featureDeltas.end());
+        size_t out = 0;
+        for (size_t i = 0; i < featureDeltas.size(); ++i) {
+            if (out > 0 && featureDeltas[out - 1].first == featureDeltas[i].first) {
+                featureDeltas[out - 1].second += featureDeltas[i].second;
+            } else {
+                featureDeltas[out++] = featureDeltas[i];
+            }
+        }
+        featureDeltas.resize(out);
+        compactedSize = out;
+    }
+
+public:
+    explicit FeedbackBatch(const FeatureHashedScorer& featureScorer) : scorer(featureScorer) {}
+
+    void add(const vector<string>& tokens, bool isSpam) {
+        messages++;
+        sorted = tokens;
+        sort(sorted.begin(), sorted.end());
+        for (size_t i = 0; i < sorted.size();) {
+            size_t run = i;
+            while (run < sorted.size() && sorted[run] == sorted[i]) ++run;
+            addTo(occurrences, sorted[i], isSpam, (double)(run - i));
+            addTo(messageCounts, sorted[i], isSpam, 1.0);
+            i = run;
+        }
+
+        slots.clear();
+        scorer.featureSlots(tokens, slots);
+        for (size_t slot : slots) featureDeltas.push_back({(uint64_t)slot << 1 | (isSpam ? 1 : 0), 1});
+        if (featureDeltas.size() > 2 * compactedSize + (1 << 16)) compactFeatures();
+    }
+
+    size_t messageCount() const { return messages; }
+    size_t distinctWords() { return occurrences.getCount(); }
+
+    // Word deltas in key order, so they are applied in one sorted pass
+    vector<WordDelta> sortedWordDeltas() {
+        vector<WordDelta> deltas;
+        deltas.reserve(occurrences.getCount());
+        occurrences.forEach([&](const WordFreq& wf) {
+            WordFreq* seen = messageCounts.search(wf.word);
+            deltas.push_back({wf.word, wf.spamFreq, wf.hamFreq, (uint32_t)seen->spamFreq, (uint32_t)seen->hamFreq});
+        });
+        sort(deltas.begin(), deltas.end(), [](const WordDelta& a, const WordDelta& b) { return a.word < b.word; });
+        return deltas;
+    }
+
+    // Apply the n-gram updates in slot order; returns the number of counter increments
+    uint64_t applyFeatureDeltas(FeatureHashedScorer& target) {
+        compactFeatures();
+        uint64_t increments = 0;
+        for (const auto& delta : featureDeltas) {
+            target.addToSlot(delta.first >> 1, delta.first & 1, delta.second);
+            increments += delta.second;
+        }
+        return increments;
+    }
+};
+
+// Words one user has trained, kept apart from the shared global model. Only the
+// user's own count deltas are stored, so a user costs memory in proportion to
+// what they trained instead of a copy of the global table.
+class UserDelta {
+private:
+    SwissHashMap counts;
+    // Sightings of words unknown to both models; created on first use
+    unique_ptr<CountMinSketch> spamSightings, hamSightings;
+
+    // Drop the least informative words once the delta outgrows its cap
+    void enforceCap(const VocabularyBudget& budget) {
+        size_t words = counts.getCount();
+        if (words <= budget.maxUserWords) return;
+        size_t toRemove = words - (size_t)(budget.maxUserWords * budget.pruneTo);
+        typedef pair<double, double> Rank;
+        vector<pair<Rank, string>> ranked;
+        counts.forEach([&](const WordFreq& wf) {
+            ranked.push_back({Rank(wordInformation(wf), wf.spamFreq + wf.hamFreq), wf.word});
+        });
+        nth_element(ranked.begin(), ranked.begin() + (toRemove - 1), ranked.end());
+        vector<string> doomed;
+        for (size_t i = 0; i < toRemove; ++i) doomed.push_back(move(ranked[i].second));
+        sort(doomed.begin(), doomed.end());
+        counts.eraseIf([&](const WordFreq& wf) { return binary_search(doomed.begin(), doomed.end(), wf.word); });
+    }
+
+public:
+    // Add a feedback batch's token counts. Its hashed n-gram updates are not
+    // kept here: the caller applies them to the shared FeatureHashedScorer.
+    // A word unknown to the shared model is admitted under the same count-min
+    // rule as feedback to that model, and the delta is capped at maxUserWords.
+    void apply(FeedbackBatch& batch, HashMap* global, const VocabularyBudget& budget) {
+        for (const FeedbackBatch::WordDelta& delta : batch.sortedWordDeltas()) {
+            WordFreq* wf = counts.search(delta.word);
+            if (wf) {
+                wf->spamFreq += delta.spamFreq;
+                wf->hamFreq += delta.hamFreq;
+                continue;
+            }
+            if (global->search(delta.word)) {
+                counts.insert(WordFreq(delta.word, delta.spamFreq, delta.hamFreq));
+                continue;
+            }
+
+            if (!spamSightings) {
+                spamSightings.reset(new CountMinSketch(1 << 12));
+                hamSightings.reset(new CountMinSketch(1 << 12));
+            }
+            for (uint32_t i = 0; i < delta.spamMessages; ++i) spamSightings->add(delta.word);
+            for (uint32_t i = 0; i < delta.hamMessages; ++i) hamSightings->add(delta.word);
+            double spamSeen = spamSightings->estimate(delta.word);
+            double hamSeen = hamSightings->estimate(delta.word);
+            if (spamSeen + hamSeen < budget.admitAfter) continue;
+            counts.insert(WordFreq(delta.word, spamSeen, hamSeen));
+        }
+        enforceCap(budget);
+    }
+
+    HashMap* map() { return &counts; }
+    size_t memoryUsage() const {
+        size_t sketches = spamSightings ? spamSightings->memoryUsage() + hamSightings->memoryUsage() : 0;
+        return counts.memoryUsage() + sketches;
+    }
+
+    // A missing file is an empty delta, not an error
+    bool load(const string& filename) {
+        if (!filesystem::exists(filename)) return true;
+        return readBinaryModel(filename, [&](const WordFreq& wf) { counts.insert(wf); });
+    }
+
+    vector<WordFreq> snapshot() {
+        vector<WordFreq> words;
+        counts.forEach([&](const WordFreq& wf) { words.push_back(wf); });
+        return words;
+    }
+
+    static bool write(const string& filename, const vector<WordFreq>& words) {
+        error_code ec;
+        filesystem::create_directories(filesystem::path(filename).parent_path(), ec);
+        return writeWordFrequenciesToBinary(filename, words);
+    }
+
+    bool save(const string& filename) { return write(filename, snapshot()); }
+};
+
+// Global counts plus one user's deltas, combined on every lookup
+class LayeredLookup : public WordLookup {
+private:
+    HashMap* global;
+    HashMap* overlay; // may be null: global model only
+
+public:
+    LayeredLookup(HashMap* globalMap, HashMap* userMap) : global(globalMap), overlay(userMap) {}
+
+    bool lookupCounts(const string& word, double& spamFreq, double& hamFreq) override {
+        WordFreq* shared = global->search(word);
+        WordFreq* own = overlay ? overlay->search(word) : nullptr;
+        if (!shared && !own) return false;
+        spamFreq = (shared ? shared->spamFreq : 0.0) + (own ? own->spamFreq : 0.0);
+        hamFreq = (shared ? shared->hamFreq : 0.0) + (own ? own->hamFreq : 0.0);
+        return true;
+    }
+};
+
+// A user name as it is stored: characters unsafe in a file name become '_', so
+// names that differ only in those characters are the same user
+string sanitizedUserName(const string& user) {
+    string name;
+    for (char c : user) name += isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.' ? c : '_';
+    return name;
+}
+
+// Per-user delta file next to the model; the user name is reduced to a safe file name
+string userDeltaFile(const string& modelFile, const string& user) {
+    return modelFile + ".users/" + sanitizedUserName(user) + ".bin";
+}
+
+// Model files used by the GUI
+const string MODEL_FILE = "/home/ka0s_5131/Desktop/Dsa_project/final.csv";
+const string FEATURE_TABLE_FILE = MODEL_FILE + ".features";
+
+// Application data structure
+struct AppData {
+    GtkWidget* window;
+    GtkWidget* textView;
+    GtkWidget* classifyButton;
+    GtkWidget* clearButton;
+    GtkWidget* loadButton;
+    GtkWidget* viewDatasetButton;
+    GtkWidget* metricsButton;
+    GtkWidget* resultLabel;
+    GtkWidget* markSpamButton;
+    GtkWidget* markHamButton;
+    GtkWidget* userEntry;
+    shared_ptr<SpamModel> model; // use currentModel(); swapped by ModelReloader
+    vector<string> currentEmailWords;
+    double spamThreshold; // Added to store threshold
+    VocabularyBudget budget;
+    CountMinSketch spamSightings;
+    CountMinSketch hamSightings;
+    FeatureHashedScorer featureScorer;
+    MessageBudget messageBudget;
+    class ModelReloader* reloader = nullptr;
+    class SnapshotWriter* snapshotWriter = nullptr;
+    bool modelSaveBlocked = false; // the model file exists but was rejected; never overwrite it
+    map<string, unique_ptr<UserDelta>> userDeltas; // loaded on first use
+};
+
+// The model new work should use
+shared_ptr<SpamModel> currentModel(AppData* app) {
+    return atomic_load(&app->model);
+}
+
+// Delta of the user named in the User field, or null for the shared model
+UserDelta* activeUserDelta(AppData* app, string* userOut = nullptr) {
+    const char* text = gtk_entry_get_text(GTK_ENTRY(app->userEntry));
+    string user = text ? text : "";
+    user.erase(0, user.find_first_not_of(" \t"));
+    user.erase(user.find_last_not_of(" \t") + 1);
+    // Keyed like the delta files, so one file never has two deltas writing it
+    user = sanitizedUserName(user);
+    if (userOut) *userOut = user;
+    if (user.empty()) return nullptr;
+
+    unique_ptr<UserDelta>& delta = app->userDeltas[user];
+    if (!delta) {
+        delta.reset(new UserDelta());
+        if (!delta->load(userDeltaFile(MODEL_FILE, user))) cerr << "Ignoring unreadable model for user " << user << endl;
+    }
+    return delta.get();
+}
+
+// Color functions for highlighting
+const char* get_spam_color(int level) {
+    switch (level) {
+        case 1: return "#FFCCCC"; // light red
+        case 2: return "#FF9999";
+        case 3: return "#FF6666";
+        case 4: return "#FF3333";
+        case 5: return "#FF0000"; // dark red
+        default: return "#FFFFFF";
+    }
+}
+
+const char* get_ham_color(int level) {
+    switch (level) {
+        case 1: return "#CCFFCC"; // light green
+        case 2: return "#99FF99";
+        case 3: return "#66FF66";
+        case 4: return "#33FF33";
+        case 5: return "#00FF00"; // dark green
+        default: return "#FFFFFF";
+    }
+}
+
+// A word to color in the text view; offsets are in characters, as GTK expects
+struct HighlightSpan {
+    size_t start;
+    size_t end;
+    double contribution; // -1 (all ham) .. 1 (all spam)
+    int level;           // 1..5 color intensity
+    string word;
+};
+
+// Work out which words to highlight and how strongly, with the same tokenizer
+// as scoring. Only the byte windows scoring reads are highlighted, with at most
+// budget.maxTokens spans split evenly between them, so a huge message costs no
+// more here than to score.
+vector<HighlightSpan> computeHighlightSpans(const char* text, size_t length, WordLookup* wordMap,
+                                            const MessageBudget& budget) {
+    vector<HighlightSpan> spans;
+    vector<pair<size_t, size_t>> windows = budgetWindows(text, length, budget);
+    size_t spansPerWindow = max<size_t>(1, budget.maxTokens / windows.size());
+    size_t scanned = 0, charBase = 0; // span offsets count code points from the start of text
+    for (const auto& window : windows) {
+        for (; scanned < window.first; ++scanned) charBase += ((unsigned char)text[scanned] & 0xC0) != 0x80;
+        size_t windowLimit = spans.size() + spansPerWindow;
+        forEachToken(text + window.first, window.second - window.first,
+                     [&](const string& word, size_t wordStartPos, size_t wordEndPos) {
+            if (spans.size() >= windowLimit) return;
+            double spamFreq, hamFreq;
+            if (!wordMap->lookupCounts(word, spamFreq, hamFreq)) return;
+            double totalFreq = spamFreq + hamFreq;
+            if (totalFreq <= 0) return;
+            double contribution = (spamFreq - hamFreq) / totalFreq;
+            if (contribution == 0) return;
+            int level = min(5, static_cast<int>(fabs(contribution) / 0.2) + 1);
+            spans.push_back({charBase + wordStartPos, charBase + wordEndPos, contribution, level, word});
+        });
+    }
+    return spans;
+}
+
+// Highlight words in the text view; text is the buffer's current contents
+void highlightWords(GtkTextBuffer* buffer, const char* text, size_t length, WordLookup* wordMap,
+                    const MessageBudget& budget) {
+    PhaseTimer timer(PHASE_HIGHLIGHT);
+    GtkTextIter start, end;
+    gtk_text_buffer_get_start_iter(buffer, &start);
+    gtk_text_buffer_get_end_iter(buffer, &end);
+    gtk_text_buffer_remove_all_tags(buffer, &start, &end);
+
+    for (const HighlightSpan& span : computeHighlightSpans(text, length, wordMap, budget)) {
+        bool spam = span.contribution > 0;
+        string tagName = (spam ? "spam-" : "ham-") + to_string(span.level);
+        GtkTextIter wordStart, wordEnd;
+        gtk_text_buffer_get_iter_at_offset(buffer, &wordStart, span.start);
+        gtk_text_buffer_get_iter_at_offset(buffer, &wordEnd, span.end);
+        gtk_text_buffer_apply_tag_by_name(buffer, tagName.c_str(), &wordStart, &wordEnd);
     }
 }
 
@@ -397,27 +3193,27 @@ void on_classify_button_clicked(GtkButton* button, gpointer user_data) {
     gtk_text_buffer_get_end_iter(buffer, &end);
     gchar* emailText = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
 
-    app->currentEmailWords.clear();
-    stringstream ss(emailText);
-    string word;
-    while (ss >> word) {
-        transform(word.begin(), word.end(), word.begin(), ::tolower);
-        word.erase(remove_if(word.begin(), word.end(), [](char c) { return !isalnum(c); }), word.end());
-        if (!word.empty()) {
-            app->currentEmailWords.push_back(word);
-        }
-    }
+    size_t emailLength = strlen(emailText);
+    bool sampled = false;
+    app->currentEmailWords = tokenizeWithinBudget(emailText, emailLength, app->messageBudget, sampled);
 
-    EmailClassifier classifier(&app->chainMap, app->spamThreshold);
-    pair<bool, double> result = classifier.classifyWithProbability(app->currentEmailWords);
-    bool isSpam = result.first;
-    double probability = result.second;
+    // Hold this version for the whole classification, even if a reload lands meanwhile
+    shared_ptr<SpamModel> model = currentModel(app);
+    UserDelta* userDelta = activeUserDelta(app);
+    LayeredLookup lookup(&model->chainMap, userDelta ? userDelta->map() : nullptr);
+    EmailClassifier classifier(&lookup, app->spamThreshold, app->messageBudget.maxTokens);
+    ClassificationResult result = classifier.classify(app->currentEmailWords, sampled);
+    bool isSpam = result.isSpam;
+    double probability = result.probability;
+    double featureProbability = app->featureScorer.classifyWithProbability(app->currentEmailWords).second;
 
     string resultText = isSpam ? "<span color='#D32F2F'>Spam" : "<span color='#388E3C'>Not Spam";
-    resultText += " (Probability: " + to_string(probability) + ")</span>";
+    resultText += " (Probability: " + to_string(probability) + ", n-gram: " + to_string(featureProbability) + ")";
+    if (result.sampled) resultText += " (sampled)";
+    resultText += "</span>";
     gtk_label_set_markup(GTK_LABEL(app->resultLabel), resultText.c_str());
 
-    highlightWords(buffer, app->currentEmailWords, &app->chainMap);
+    highlightWords(buffer, emailText, emailLength, &lookup, app->messageBudget);
 
     gtk_widget_set_sensitive(app->markSpamButton, TRUE);
     gtk_widget_set_sensitive(app->markHamButton, TRUE);
@@ -451,19 +3247,27 @@ void on_load_button_clicked(GtkButton* button, gpointer user_data) {
 
     GtkFileFilter* filter = gtk_file_filter_new();
     gtk_file_filter_add_pattern(filter, "*.txt");
+    gtk_file_filter_add_pattern(filter, "*.eml");
     gtk_file_chooser_set_filter(GTK_FILE_CHOOSER(dialog), filter);
 
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
         char* filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
-        ifstream file(filename);
+        ifstream file(filename, ios::binary);
         if (file.is_open()) {
-            stringstream buffer;
-            buffer << file.rdbuf();
-            string content = buffer.str();
+            // Stream the raw message through the MIME preprocessor so attachments
+            // and markup never reach the text view or the tokenizer
+            MimeTextExtractor extractor;
+            vector<char> chunk(64 * 1024);
+            while (file.read(chunk.data(), chunk.size()) || file.gcount() > 0) {
+                extractor.feed(chunk.data(), file.gcount());
+            }
+            string content = extractor.finish();
             file.close();
 
+            gchar* validText = g_utf8_make_valid(content.c_str(), content.size());
             GtkTextBuffer* textBuffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(app->textView));
-            gtk_text_buffer_set_text(textBuffer, content.c_str(), -1);
+            gtk_text_buffer_set_text(textBuffer, validText, -1);
+            g_free(validText);
             gtk_label_set_text(GTK_LABEL(app->resultLabel), "");
             app->currentEmailWords.clear();
             gtk_widget_set_sensitive(app->markSpamButton, FALSE);
@@ -499,13 +3303,14 @@ void on_properties_button_clicked(GtkButton* button, gpointer user_data) {
     AppData* app = static_cast<AppData*>(user_data);
 
     // Calculate dataset properties
-    int totalWords = app->chainMap.getCount();
+    shared_ptr<SpamModel> model = currentModel(app);
+    int totalWords = model->chainMap.getCount();
     double totalSpamFreq = 0.0, totalHamFreq = 0.0;
     string maxSpamWord = "None", maxHamWord = "None";
     double maxSpamFreq = 0.0, maxHamFreq = 0.0;
 
-    for (const string& word : app->wordsOrder) {
-        WordFreq* wf = app->chainMap.search(word);
+    for (const string& word : model->wordsOrder) {
+        WordFreq* wf = model->chainMap.search(word);
         if (wf) {
             totalSpamFreq += wf->spamFreq;
             totalHamFreq += wf->hamFreq;
@@ -522,7 +3327,9 @@ void on_properties_button_clicked(GtkButton* button, gpointer user_data) {
 
     string dominantCategory = (totalSpamFreq > totalHamFreq) ? "Spam" :
                              (totalHamFreq > totalSpamFreq) ? "Ham" : "Equal";
-    double loadFactor = app->chainMap.getLoadFactor();
+    double loadFactor = model->chainMap.getLoadFactor();
+    HashMapStats chainStats = model->chainMap.collectStats();
+    HashMapStats openStats = model->openMap.collectStats();
 
     // Create properties text
     stringstream ss;
@@ -532,6 +3339,15 @@ void on_properties_button_clicked(GtkButton* button, gpointer user_data) {
        << "Total Ham Frequency: " << totalHamFreq << "\n"
        << "Dominant Category: " << dominantCategory << "\n"
        << "Hash Map Load Factor: " << loadFactor << "\n"
+       << "Vocabulary Budget: " << totalWords << " / " << app->budget.maxWords << " words\n"
+       << "Model Memory: " << model->chainMap.memoryUsage() / 1024 << " KiB ("
+       << (totalWords ? (double)model->chainMap.memoryUsage() / totalWords : 0.0) << " bytes/word)\n"
+       << "Hash Function: " << hashFunctionName(model->chainMap.getHashFunction()) << "\n"
+       << "Chaining Collisions: " << chainStats.collisions
+       << " (max chain " << chainStats.maxChainLength << ")\n"
+       << "Open Addressing Collisions: " << openStats.collisions
+       << " (max probe " << openStats.maxProbeLength
+       << ", avg " << openStats.avgProbeLength << ")\n"
        << "Most Frequent Spam Word: " << maxSpamWord << " (" << maxSpamFreq << ")\n"
        << "Most Frequent Ham Word: " << maxHamWord << " (" << maxHamFreq << ")\n"
        << "Current Spam Threshold: " << app->spamThreshold << "\n";
@@ -639,16 +3455,26 @@ void on_apply_filter_button_clicked(GtkButton* button, gpointer user_data) {
     // Get sort criterion
     int sort_criterion = gtk_combo_box_get_active(GTK_COMBO_BOX(fs_data->sort_combo));
 
-    // Collect and filter words
+    // Collect and filter words. "abc*" is a prefix query answered by the trie
+    // index; any other text matches anywhere in the word.
+    shared_ptr<SpamModel> model = currentModel(app);
+    bool prefix_query = !alpha_filter_str.empty() && alpha_filter_str.back() == '*';
+    vector<string> prefix_matches;
+    if (prefix_query) {
+        alpha_filter_str.pop_back();
+        model->wordPrefixIndex().forEachWithPrefix(alpha_filter_str, [&](const string& word, uint32_t) {
+            prefix_matches.push_back(word);
+        });
+    }
     vector<pair<string, WordFreq>> filtered_words;
-    for (const string& word : app->wordsOrder) {
-        WordFreq* wf = app->chainMap.search(word);
+    for (const string& word : prefix_query ? prefix_matches : model->wordsOrder) {
+        WordFreq* wf = model->chainMap.search(word);
         if (!wf) continue;
 
         // Apply alphabetical filter
         string word_lower = word;
         transform(word_lower.begin(), word_lower.end(), word_lower.begin(), ::tolower);
-        if (!alpha_filter_str.empty() && word_lower.find(alpha_filter_str) == string::npos) {
+        if (!prefix_query && !alpha_filter_str.empty() && word_lower.find(alpha_filter_str) == string::npos) {
             continue;
         }
 
@@ -760,7 +3586,7 @@ void open_filter_dialog(GtkButton* button, gpointer user_data) {
     // Alphabetical filter
     GtkWidget* alpha_label = gtk_label_new("Alphabetical Filter:");
     GtkWidget* alpha_entry = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(alpha_entry), "Enter substring (e.g., 'free')");
+    gtk_entry_set_placeholder_text(GTK_ENTRY(alpha_entry), "Substring (e.g., 'free') or prefix (e.g., 'win*')");
     GtkWidget* alpha_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 5);
     gtk_box_pack_start(GTK_BOX(alpha_hbox), alpha_label, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(alpha_hbox), alpha_entry, TRUE, TRUE, 0);
@@ -920,65 +3746,436 @@ void on_view_dataset_button_clicked(GtkButton* button, gpointer user_data) {
     fs_data->app = app;
     fs_data->store = store;
 
-    // Initial population (no filter)
-    fs_data->alpha_entry = gtk_entry_new();
-    fs_data->spam_count_entry = gtk_entry_new();
-    fs_data->ham_count_entry = gtk_entry_new();
-    fs_data->spam_score_entry = gtk_entry_new();
-    fs_data->ham_score_entry = gtk_entry_new();
-    fs_data->spam_count_combo = gtk_combo_box_text_new();
-    fs_data->ham_count_combo = gtk_combo_box_text_new();
-    fs_data->spam_score_combo = gtk_combo_box_text_new();
-    fs_data->ham_score_combo = gtk_combo_box_text_new();
-    fs_data->sort_combo = gtk_combo_box_text_new();
-    on_apply_filter_button_clicked(NULL, fs_data);
+    // Initial population (no filter)
+    fs_data->alpha_entry = gtk_entry_new();
+    fs_data->spam_count_entry = gtk_entry_new();
+    fs_data->ham_count_entry = gtk_entry_new();
+    fs_data->spam_score_entry = gtk_entry_new();
+    fs_data->ham_score_entry = gtk_entry_new();
+    fs_data->spam_count_combo = gtk_combo_box_text_new();
+    fs_data->ham_count_combo = gtk_combo_box_text_new();
+    fs_data->spam_score_combo = gtk_combo_box_text_new();
+    fs_data->ham_score_combo = gtk_combo_box_text_new();
+    fs_data->sort_combo = gtk_combo_box_text_new();
+    on_apply_filter_button_clicked(NULL, fs_data);
+
+    // Connect signals
+    g_signal_connect(properties_button, "clicked", G_CALLBACK(on_properties_button_clicked), app);
+    g_signal_connect(filter_button, "clicked", G_CALLBACK(open_filter_dialog), fs_data);
+    g_signal_connect_swapped(dialog, "response", G_CALLBACK(gtk_widget_destroy), dialog);
+
+    gtk_widget_show_all(dialog);
+    gtk_dialog_run(GTK_DIALOG(dialog));
+
+    delete fs_data;
+}
+
+// Apply a feedback batch to the in-memory model: one update per distinct word
+// in sorted order, keeping both maps in step. Unseen words are admitted only
+// once they recur across messages.
+void applyFeedbackBatch(AppData* app, FeedbackBatch& batch) {
+    PhaseTimer timer(PHASE_FEEDBACK);
+    shared_ptr<SpamModel> model = currentModel(app);
+    for (const FeedbackBatch::WordDelta& delta : batch.sortedWordDeltas()) {
+        WordFreq* wf = model->chainMap.search(delta.word);
+        if (wf) {
+            wf->spamFreq += delta.spamFreq;
+            wf->hamFreq += delta.hamFreq;
+            WordFreq* slot = model->openMap.search(delta.word);
+            if (slot) {
+                slot->spamFreq = wf->spamFreq;
+                slot->hamFreq = wf->hamFreq;
+            }
+            continue;
+        }
+
+        for (uint32_t i = 0; i < delta.spamMessages; ++i) app->spamSightings.add(delta.word);
+        for (uint32_t i = 0; i < delta.hamMessages; ++i) app->hamSightings.add(delta.word);
+        double spamSeen = app->spamSightings.estimate(delta.word);
+        double hamSeen = app->hamSightings.estimate(delta.word);
+        if (spamSeen + hamSeen < app->budget.admitAfter) continue;
+
+        WordFreq newWf(delta.word, spamSeen, hamSeen);
+        model->chainMap.insert(newWf);
+        model->openMap.insert(newWf);
+        model->wordsOrder.push_back(delta.word);
+        model->vocabularyChanges++;
+    }
+    batch.applyFeatureDeltas(app->featureScorer);
+    enforceVocabularyBudget(*model, app->budget);
+}
+
+// Apply the current email's words to the in-memory model
+void applyFeedbackToModel(AppData* app, bool isSpam) {
+    FeedbackBatch batch(app->featureScorer);
+    batch.add(app->currentEmailWords, isSpam);
+    applyFeedbackBatch(app, batch);
+}
+
+// Metrics button callback
+void on_metrics_button_clicked(GtkButton* button, gpointer user_data) {
+    AppData* app = static_cast<AppData*>(user_data);
+
+    string summary = metrics().renderSummary();
+    gchar* escaped = g_markup_escape_text(summary.c_str(), -1);
+    string markup = string("<b>Runtime Metrics</b>\n\n<tt>") + escaped + "</tt>";
+    g_free(escaped);
+
+    GtkWidget* dialog = gtk_dialog_new_with_buttons("Metrics",
+                                                   GTK_WINDOW(app->window),
+                                                   GTK_DIALOG_MODAL,
+                                                   "_Close",
+                                                   GTK_RESPONSE_CLOSE,
+                                                   NULL);
+    gtk_window_set_default_size(GTK_WINDOW(dialog), 600, 400);
+
+    GtkWidget* label = gtk_label_new(NULL);
+    gtk_label_set_markup(GTK_LABEL(label), markup.c_str());
+    gtk_label_set_justify(GTK_LABEL(label), GTK_JUSTIFY_LEFT);
+    gtk_widget_set_margin_start(label, 10);
+    gtk_widget_set_margin_end(label, 10);
+    gtk_widget_set_margin_top(label, 10);
+    gtk_widget_set_margin_bottom(label, 10);
+
+    GtkWidget* content_area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    gtk_box_pack_start(GTK_BOX(content_area), label, TRUE, TRUE, 0);
+
+    gtk_widget_show_all(dialog);
+    gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+}
+
+// Periodic Prometheus dump; user_data is the heap-allocated output path
+gboolean on_metrics_dump_timeout(gpointer user_data) {
+    const string* filename = static_cast<const string*>(user_data);
+    if (!metrics().writePrometheusFile(*filename)) {
+        cerr << "Error writing metrics file: " << *filename << endl;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+// A reloaded model waiting to be published on the GTK main thread
+struct ModelSwap {
+    AppData* app;
+    shared_ptr<SpamModel> model;
+};
+
+// Publish a reloaded model; classifications started earlier keep their version
+gboolean on_model_swap_idle(gpointer user_data) {
+    ModelSwap* swap = static_cast<ModelSwap*>(user_data);
+    atomic_store(&swap->app->model, swap->model);
+    swap->app->modelSaveBlocked = false;
+    string message = "<span color='#1976D2'>Model reloaded (" + to_string(swap->model->wordsOrder.size()) +
+                     " words, version " + to_string(swap->model->version) + ")</span>";
+    gtk_label_set_markup(GTK_LABEL(swap->app->resultLabel), message.c_str());
+    cout << "Model reloaded: version " << swap->model->version << ", " << swap->model->wordsOrder.size() << " words" << endl;
+    delete swap;
+    return G_SOURCE_REMOVE;
+}
+
+// Reloads the model file in the background when it changes. Changes are seen
+// with inotify on the file's directory, which also catches deploys that rename
+// a new file into place, or requested with SIGHUP. A burst of events is allowed
+// to settle, then the file is loaded and validated on the reload thread and the
+// result handed to the main thread to publish. Saves made by this process are
+// recognized by their stat stamp and not reloaded.
+class ModelReloader {
+private:
+    static constexpr chrono::milliseconds SETTLE_TIME{250};
+
+    AppData* app;
+    string path;
+    mutex lock;
+    condition_variable wake;
+    bool pending = false;
+    bool forced = false;
+    bool stopping = false;
+    FileStamp knownStamp; // the version on disk this process already has
+    uint64_t nextVersion = 1;
+    int inotifyFd = -1;
+    int stopFd = -1;
+    thread watchThread;
+    thread loadThread;
+
+    void watchLoop() {
+        filesystem::path file(path);
+        string name = file.filename().string();
+        alignas(inotify_event) char buffer[4096];
+        pollfd fds[2] = {{inotifyFd, POLLIN, 0}, {stopFd, POLLIN, 0}};
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            if (fds[1].revents) return;
+            if (!(fds[0].revents & POLLIN)) continue;
+            ssize_t length = read(inotifyFd, buffer, sizeof(buffer));
+            if (length <= 0) continue;
+            for (char* p = buffer; p < buffer + length;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                if (event->len > 0 && name == event->name) requestReload(false);
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+
+    void loadLoop() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return pending || stopping; });
+            if (stopping) return;
+            // Wait until events stop arriving, so a file is read once its writer is done
+            pending = false;
+            if (wake.wait_for(guard, SETTLE_TIME, [&] { return pending || stopping; })) continue;
+
+            bool force = forced;
+            forced = false;
+            if (!force && statFile(path) == knownStamp) continue;
+
+            guard.unlock();
+            FileStamp stamp;
+            shared_ptr<SpamModel> model = loadSpamModel(path, &stamp);
+            guard.lock();
+            if (!model) {
+                cerr << "Model reload rejected; keeping the current model" << endl;
+                continue;
+            }
+            knownStamp = stamp;
+            model->version = nextVersion++;
+            g_idle_add(on_model_swap_idle, new ModelSwap{app, model});
+        }
+    }
+
+public:
+    ModelReloader(AppData* appData, const string& modelPath) : app(appData), path(modelPath) {}
+
+    ~ModelReloader() { stop(); }
+
+    // Start watching; `loaded` is the stamp of the version already in memory
+    void start(const FileStamp& loaded) {
+        knownStamp = loaded;
+        stopFd = eventfd(0, EFD_CLOEXEC);
+        inotifyFd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        string directory = filesystem::path(path).parent_path().string();
+        if (inotifyFd < 0 || inotify_add_watch(inotifyFd, directory.empty() ? "." : directory.c_str(),
+                                               IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            cerr << "Cannot watch " << path << " for changes; reload with SIGHUP instead" << endl;
+        } else {
+            watchThread = thread(&ModelReloader::watchLoop, this);
+        }
+        loadThread = thread(&ModelReloader::loadLoop, this);
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (stopFd >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = write(stopFd, &one, sizeof(one));
+            (void)ignored;
+        }
+        if (watchThread.joinable()) watchThread.join();
+        if (loadThread.joinable()) loadThread.join();
+        if (inotifyFd >= 0) close(inotifyFd);
+        if (stopFd >= 0) close(stopFd);
+        inotifyFd = stopFd = -1;
+    }
+
+    // force reloads even if the file looks unchanged (SIGHUP)
+    void requestReload(bool force) {
+        {
+            lock_guard<mutex> guard(lock);
+            pending = true;
+            forced = forced || force;
+        }
+        wake.notify_all();
+    }
+
+    // Record a save made by this process so it is not reloaded as a new model.
+    // Called before the file is renamed into place.
+    void noteOwnWrite(const FileStamp& written) {
+        lock_guard<mutex> guard(lock);
+        knownStamp = written;
+    }
+};
+
+// SIGHUP handler (dispatched on the main loop): reload the model now
+gboolean on_reload_signal(gpointer user_data) {
+    static_cast<ModelReloader*>(user_data)->requestReload(true);
+    return G_SOURCE_CONTINUE;
+}
+
+gboolean on_snapshot_dispatch_idle(gpointer user_data);
+
+// Writes files on a background thread so the UI never waits on the disk.
+// Callers only mark a file dirty, with a function that copies what is to be
+// written. The copies are taken on the GTK main thread when the writer is free
+// for them, so a burst of feedback during a save costs one copy and one write
+// per file. Stopping writes whatever is still dirty.
+class SnapshotWriter {
+public:
+    typedef function<bool()> Write;     // runs on the writer thread
+    typedef function<Write()> Snapshot; // runs on the main thread and copies the data
+
+private:
+    map<string, Snapshot> dirty; // main thread only
+    bool dispatchScheduled = false;
+    bool stopped = false;
+    mutex lock;
+    condition_variable wake;
+    vector<pair<string, Write>> batch; // copies handed to the worker
+    bool busy = false;                 // a batch is being written
+    bool stopping = false;
+    thread worker;
+
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [&] { return !batch.empty() || stopping; });
+            if (batch.empty()) return;
+            vector<pair<string, Write>> writes;
+            writes.swap(batch);
+            guard.unlock();
+            for (auto& write : writes)
+                if (!write.second()) cerr << "Error saving " << write.first << endl;
+            guard.lock();
+            busy = false;
+            // Pick up files dirtied while this batch was written
+            if (!stopping) g_idle_add(on_snapshot_dispatch_idle, this);
+        }
+    }
+
+public:
+    SnapshotWriter() : worker(&SnapshotWriter::run, this) {}
+    ~SnapshotWriter() { stop(); }
+
+    // Main thread: snapshot the dirty files and hand them over, unless a batch is still being written
+    void dispatch() {
+        dispatchScheduled = false;
+        {
+            lock_guard<mutex> guard(lock);
+            if (busy || stopping || dirty.empty()) return;
+            busy = true;
+        }
+        vector<pair<string, Write>> writes;
+        for (auto& entry : dirty) writes.push_back({entry.first, entry.second()});
+        dirty.clear();
+        {
+            lock_guard<mutex> guard(lock);
+            batch.swap(writes);
+        }
+        wake.notify_one();
+    }
+
+    // Main thread: schedule a save; a later mark for the same file replaces this one
+    void markDirty(const string& file, Snapshot snapshot) {
+        if (stopped) {
+            if (!snapshot()()) cerr << "Error saving " << file << endl;
+            return;
+        }
+        dirty[file] = move(snapshot);
+        if (!dispatchScheduled) {
+            dispatchScheduled = true;
+            g_idle_add(on_snapshot_dispatch_idle, this);
+        }
+    }
+
+    // Main thread: finish the batch being written, then write the rest here
+    void stop() {
+        if (stopped) return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable()) worker.join();
+        stopped = true;
+        for (auto& entry : dirty)
+            if (!entry.second()()) cerr << "Error saving " << entry.first << endl;
+        dirty.clear();
+    }
+};
 
-    // Connect signals
-    g_signal_connect(properties_button, "clicked", G_CALLBACK(on_properties_button_clicked), app);
-    g_signal_connect(filter_button, "clicked", G_CALLBACK(open_filter_dialog), fs_data);
-    g_signal_connect_swapped(dialog, "response", G_CALLBACK(gtk_widget_destroy), dialog);
+gboolean on_snapshot_dispatch_idle(gpointer user_data) {
+    static_cast<SnapshotWriter*>(user_data)->dispatch();
+    return G_SOURCE_REMOVE;
+}
 
-    gtk_widget_show_all(dialog);
-    gtk_dialog_run(GTK_DIALOG(dialog));
+// Mark the n-gram table for saving; it is shared by every user
+void saveFeatureTableInBackground(AppData* app) {
+    app->snapshotWriter->markDirty(FEATURE_TABLE_FILE, [app]() -> SnapshotWriter::Write {
+        auto features = make_shared<FeatureHashedScorer>(app->featureScorer);
+        return [features] { return features->save(FEATURE_TABLE_FILE); };
+    });
+}
 
-    delete fs_data;
+// Mark the shared model and the n-gram table for saving. Each is copied when
+// the writer takes it, so the file holds one consistent state of the model.
+void saveModelInBackground(AppData* app) {
+    app->snapshotWriter->markDirty(MODEL_FILE, [app]() -> SnapshotWriter::Write {
+        auto words = make_shared<vector<WordFreq>>(snapshotWords(*currentModel(app)));
+        ModelReloader* reloader = app->reloader;
+        return [words, reloader] {
+            // The stamp is recorded before the rename, so the reloader can never
+            // see the new file as someone else's and swap it over newer feedback
+            StampListener noteOwnWrite;
+            if (reloader) noteOwnWrite = [reloader](const FileStamp& stamp) { reloader->noteOwnWrite(stamp); };
+            return writeModelFile(MODEL_FILE, *words, isBinaryModelFile(MODEL_FILE), noteOwnWrite);
+        };
+    });
+    saveFeatureTableInBackground(app);
 }
 
-// Update word frequencies based on user feedback
-void updateFrequencies(AppData* app, bool isSpam) {
-    for (string word : app->currentEmailWords) {
-        // Normalize word
-        transform(word.begin(), word.end(), word.begin(), ::tolower);
-        word.erase(remove_if(word.begin(), word.end(), [](char c) { return !isalnum(c); }), word.end());
-        if (word.empty()) continue;
-        WordFreq* wf = app->chainMap.search(word);
-        if (wf) {
-            if (isSpam) {
-                wf->spamFreq += 1;
-            } else {
-                wf->hamFreq += 1;
-            }
-        } else {
-            WordFreq newWf(word, isSpam ? 1.0 : 0.0, isSpam ? 0.0 : 1.0);
-            app->chainMap.insert(newWf);
-            app->openMap.insert(newWf);
-            app->wordsOrder.push_back(word);
-        }
+// Update word frequencies based on user feedback. With a user selected only that
+// user's delta changes; the shared word model is left alone, but the n-gram
+// table, which has no per-user layer, still learns. Returns false, changing
+// nothing, while the model file on disk is one that failed to load.
+bool updateFrequencies(AppData* app, bool isSpam) {
+    string user;
+    UserDelta* userDelta = activeUserDelta(app, &user);
+    if (userDelta) {
+        FeedbackBatch batch(app->featureScorer);
+        batch.add(app->currentEmailWords, isSpam);
+        userDelta->apply(batch, &currentModel(app)->chainMap, app->budget);
+        batch.applyFeatureDeltas(app->featureScorer);
+        saveFeatureTableInBackground(app);
+        string file = userDeltaFile(MODEL_FILE, user);
+        app->snapshotWriter->markDirty(file, [userDelta, file]() -> SnapshotWriter::Write {
+            auto words = make_shared<vector<WordFreq>>(userDelta->snapshot());
+            return [words, file] { return UserDelta::write(file, *words); };
+        });
+        return true;
     }
-    saveWordFrequenciesToTransposedCSV("/home/ka0s_5131/Desktop/Dsa_project/final.csv", app->wordsOrder, &app->chainMap);
+
+    if (app->modelSaveBlocked) return false;
+    applyFeedbackToModel(app, isSpam);
+    saveModelInBackground(app);
+    return true;
 }
 
+const char* const FEEDBACK_BLOCKED_MARKUP =
+    "<span color='#F57C00'>Model file failed to load: feedback is off until a valid model is loaded</span>";
+
 // Mark as Spam button callback
 void on_mark_spam_button_clicked(GtkButton* button, gpointer user_data) {
     AppData* app = static_cast<AppData*>(user_data);
-    updateFrequencies(app, true);
+    if (!updateFrequencies(app, true)) {
+        gtk_label_set_markup(GTK_LABEL(app->resultLabel), FEEDBACK_BLOCKED_MARKUP);
+        return;
+    }
     gtk_label_set_markup(GTK_LABEL(app->resultLabel), "<span color='#D32F2F'>Frequencies updated as Spam</span>");
 }
 
 // Mark as Ham button callback
 void on_mark_ham_button_clicked(GtkButton* button, gpointer user_data) {
     AppData* app = static_cast<AppData*>(user_data);
-    updateFrequencies(app, false);
+    if (!updateFrequencies(app, false)) {
+        gtk_label_set_markup(GTK_LABEL(app->resultLabel), FEEDBACK_BLOCKED_MARKUP);
+        return;
+    }
     gtk_label_set_markup(GTK_LABEL(app->resultLabel), "<span color='#388E3C'>Frequencies updated as Ham</span>");
 }
 
@@ -1008,6 +4205,8 @@ void apply_css() {
         ".mark-spam-button:hover { background-color: #E04848; }"
         ".mark-ham-button { background-color: #2196F3; color: #FFFFFF; padding: 10px; font-weight: bold; border: none; }"
         ".mark-ham-button:hover { background-color: #1E88E5; }"
+        ".metrics-button { background-color: #4CAF50; color: #FFFFFF; padding: 10px; font-weight: bold; border: none; }"
+        ".metrics-button:hover { background-color: #45A049; }"
         ".result-label { font-weight: bold; font-size: 16px; margin: 10px; }"
         "box { padding: 10px; }",
         -1, &error)) {
@@ -1021,8 +4220,1069 @@ void apply_css() {
     g_object_unref(provider);
 }
 
+// Labeled corpus root given on the command line (maildir tree, message file or mbox)
+struct CorpusSource {
+    string path;
+    bool isSpam;
+};
+
+// One unit of training work: a single message file or a byte range of an mbox file
+struct CorpusWorkItem {
+    string path;
+    bool isSpam;
+    bool isMbox;
+    uint64_t begin;
+    uint64_t end;
+};
+
+bool isMboxFile(const string& path) {
+    ifstream file(path, ios::binary);
+    char head[5] = {};
+    file.read(head, 5);
+    return file.gcount() == 5 && memcmp(head, "From ", 5) == 0;
+}
+
+// Expand corpus roots into work items; mbox files are split into byte ranges so a
+// single large mailbox still spreads across all threads
+vector<CorpusWorkItem> enumerateCorpus(const vector<CorpusSource>& sources, uint64_t mboxChunkBytes = 64ull << 20) {
+    vector<CorpusWorkItem> items;
+    auto addFile = [&](const string& path, bool isSpam) {
+        if (!isMboxFile(path)) {
+            items.push_back({path, isSpam, false, 0, 0});
+            return;
+        }
+        uint64_t fileSize = filesystem::file_size(path);
+        for (uint64_t begin = 0; begin < fileSize; begin += mboxChunkBytes)
+            items.push_back({path, isSpam, true, begin, min(fileSize, begin + mboxChunkBytes)});
+    };
+
+    for (const CorpusSource& source : sources) {
+        error_code ec;
+        if (filesystem::is_directory(source.path, ec)) {
+            auto options = filesystem::directory_options::skip_permission_denied;
+            for (auto it = filesystem::recursive_directory_iterator(source.path, options, ec);
+                 it != filesystem::recursive_directory_iterator(); it.increment(ec)) {
+                if (ec) break;
+                if (it->is_regular_file(ec)) addFile(it->path().string(), source.isSpam);
+            }
+        } else if (filesystem::is_regular_file(source.path, ec)) {
+            addFile(source.path, source.isSpam);
+        } else {
+            cerr << "Corpus path not found: " << source.path << endl;
+        }
+    }
+    return items;
+}
+
+// Invoke onMessage for every message of a work item. An mbox range owns exactly the
+// messages whose "From " separator line starts inside [begin, end).
+void forEachCorpusMessage(const CorpusWorkItem& item, const function<void(const string&)>& onMessage) {
+    ifstream file(item.path, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error opening file: " << item.path << endl;
+        return;
+    }
+
+    if (!item.isMbox) {
+        stringstream buffer;
+        buffer << file.rdbuf();
+        onMessage(buffer.str());
+        return;
+    }
+
+    string line, message;
+    uint64_t lineStart = item.begin;
+    if (item.begin > 0) {
+        // Skip the line we landed in unless the range starts exactly on a line boundary
+        file.seekg(item.begin - 1);
+        if (file.get() != '\n') {
+            getline(file, line);
+            lineStart += line.size() + 1;
+        }
+    }
+
+    bool inMessage = false;
+    while (getline(file, line)) {
+        uint64_t thisLineStart = lineStart;
+        lineStart += line.size() + 1;
+
+        if (line.compare(0, 5, "From ") == 0) {
+            if (inMessage) {
+                onMessage(message);
+                message.clear();
+            }
+            if (thisLineStart >= item.end) return;
+            inMessage = true;
+            continue;
+        }
+        if (!inMessage) continue;
+
+        // mboxrd: un-escape ">From " lines
+        size_t quotes = line.find_first_not_of('>');
+        if (quotes > 0 && quotes != string::npos && line.compare(quotes, 5, "From ") == 0)
+            line.erase(0, 1);
+        message += line;
+        message += '\n';
+    }
+    if (inMessage) onMessage(message);
+}
+
+// Cross-validation fold of a message, stable across runs and thread counts
+unsigned messageFold(const string& message, unsigned folds) {
+    return wyhash64(message.data(), message.size(), 0x243f6a8885a308d3ull) % folds;
+}
+
+// Key under which a word's counts from one fold are kept next to its totals
+string foldKey(const string& word, unsigned fold) {
+    string key = word;
+    key += '\0';
+    key += to_string(fold);
+    return key;
+}
+
+// Count spam/ham word frequencies over a labeled corpus with the given number of
+// threads. Each thread counts into its own table and splits it into per-thread
+// partitions by hash, so the merge runs in parallel with no shared writes.
+// With folds > 0 every word is also counted under foldKey(word, fold of its message).
+vector<WordFreq> trainFromCorpus(const vector<CorpusSource>& sources, unsigned threads,
+                                 uint64_t& messagesOut, uint64_t& bytesOut, unsigned folds = 0) {
+    const int TABLE_BUCKETS = 1048573;
+    const uint64_t PARTITION_SEED = 0x9e3779b97f4a7c15ull;
+
+    vector<CorpusWorkItem> items = enumerateCorpus(sources);
+    atomic<size_t> nextItem{0};
+    atomic<uint64_t> messages{0}, bytes{0};
+    vector<vector<vector<WordFreq>>> partitions(threads, vector<vector<WordFreq>>(threads));
+
+    auto countWorker = [&](unsigned t) {
+        ChainingHashMap local(TABLE_BUCKETS);
+        for (size_t i = nextItem++; i < items.size(); i = nextItem++) {
+            bool isSpam = items[i].isSpam;
+            forEachCorpusMessage(items[i], [&](const string& message) {
+                auto count = [&](const string& key) {
+                    WordFreq* wf = local.search(key);
+                    if (!wf) {
+                        local.insert(WordFreq(key));
+                        wf = local.search(key);
+                    }
+                    (isSpam ? wf->spamFreq : wf->hamFreq) += 1;
+                };
+                unsigned fold = folds ? messageFold(message, folds) : 0;
+                string text = extractMessageText(message);
+                for (const string& word : tokenizeEmail(text.data(), text.size())) {
+                    count(word);
+                    if (folds) count(foldKey(word, fold));
+                }
+                messages.fetch_add(1, memory_order_relaxed);
+                bytes.fetch_add(message.size(), memory_order_relaxed);
+            });
+        }
+        local.forEach([&](const WordFreq& wf) {
+            partitions[t][wyhash64(wf.word.data(), wf.word.size(), PARTITION_SEED) % threads].push_back(wf);
+        });
+    };
+
+    vector<vector<WordFreq>> merged(threads);
+    auto mergeWorker = [&](unsigned p) {
+        ChainingHashMap table(TABLE_BUCKETS);
+        for (unsigned t = 0; t < threads; ++t) {
+            for (const WordFreq& part : partitions[t][p]) {
+                WordFreq* wf = table.search(part.word);
+                if (wf) {
+                    wf->spamFreq += part.spamFreq;
+                    wf->hamFreq += part.hamFreq;
+                } else {
+                    table.insert(part);
+                }
+            }
+            vector<WordFreq>().swap(partitions[t][p]);
+        }
+        merged[p].reserve(table.getCount());
+        table.forEach([&](const WordFreq& wf) { merged[p].push_back(wf); });
+    };
+
+    vector<thread> pool;
+    for (unsigned t = 0; t < threads; ++t) pool.emplace_back(countWorker, t);
+    for (thread& th : pool) th.join();
+    pool.clear();
+    for (unsigned p = 0; p < threads; ++p) pool.emplace_back(mergeWorker, p);
+    for (thread& th : pool) th.join();
+
+    vector<WordFreq> words;
+    for (vector<WordFreq>& part : merged) {
+        words.insert(words.end(), make_move_iterator(part.begin()), make_move_iterator(part.end()));
+        vector<WordFreq>().swap(part);
+    }
+    // Most frequent words first, matching the layout of the shipped dataset
+    sort(words.begin(), words.end(), [](const WordFreq& a, const WordFreq& b) {
+        double totalA = a.spamFreq + a.hamFreq, totalB = b.spamFreq + b.hamFreq;
+        return totalA != totalB ? totalA > totalB : a.word < b.word;
+    });
+
+    messagesOut = messages;
+    bytesOut = bytes;
+    return words;
+}
+
+// Counts of a cross-validation training set: corpus totals minus one held-out
+// fold, computed per lookup so no fold model is ever materialized
+class FoldView : public WordLookup {
+private:
+    HashMap* counts; // totals under each word, per-fold counts under foldKey()
+    unsigned fold;
+
+public:
+    FoldView(HashMap* foldCounts, unsigned heldOutFold) : counts(foldCounts), fold(heldOutFold) {}
+
+    bool lookupCounts(const string& word, double& spamFreq, double& hamFreq) override {
+        WordFreq* total = counts->search(word);
+        if (!total) return false;
+        WordFreq* heldOut = counts->search(foldKey(word, fold));
+        spamFreq = total->spamFreq - (heldOut ? heldOut->spamFreq : 0.0);
+        hamFreq = total->hamFreq - (heldOut ? heldOut->hamFreq : 0.0);
+        return true;
+    }
+};
+
+// Classifier output for one labeled message
+struct ScoredMessage {
+    double probability;
+    bool isSpam;
+};
+
+// Score every message of a corpus in parallel. lookupFor picks the model a
+// message is scored against (the same one, or its fold's training view).
+vector<ScoredMessage> scoreCorpus(const vector<CorpusSource>& sources, unsigned threads,
+                                  const function<WordLookup*(const string&)>& lookupFor) {
+    vector<CorpusWorkItem> items = enumerateCorpus(sources);
+    atomic<size_t> nextItem{0};
+    vector<vector<ScoredMessage>> results(threads);
+
+    auto scoreWorker = [&](unsigned t) {
+        for (size_t i = nextItem++; i < items.size(); i = nextItem++) {
+            bool isSpam = items[i].isSpam;
+            forEachCorpusMessage(items[i], [&](const string& message) {
+                string text = extractMessageText(message);
+                EmailClassifier classifier(lookupFor(message));
+                double probability = classifier.classifyWithProbability(tokenizeEmail(text.data(), text.size())).second;
+                results[t].push_back({probability, isSpam});
+            });
+        }
+    };
+
+    vector<thread> pool;
+    for (unsigned t = 0; t < threads; ++t) pool.emplace_back(scoreWorker, t);
+    for (thread& th : pool) th.join();
+
+    vector<ScoredMessage> scores;
+    for (vector<ScoredMessage>& part : results) scores.insert(scores.end(), part.begin(), part.end());
+    return scores;
+}
+
+// Confusion counts when every message scoring >= threshold is called spam
+struct OperatingPoint {
+    double threshold;
+    uint64_t truePositives;
+    uint64_t falsePositives;
+    double truePositiveRate;  // recall
+    double falsePositiveRate;
+    double precision;
+};
+
+struct EvaluationReport {
+    uint64_t spamMessages = 0;
+    uint64_t hamMessages = 0;
+    vector<OperatingPoint> curve; // one point per distinct score, thresholds descending
+    double rocAuc = 0.0;
+    double averagePrecision = 0.0;
+};
+
+// ROC and precision/recall over every possible threshold from one sort and one
+// sweep: lowering the threshold past a score moves exactly the messages with that
+// score to the spam side, so the counts are carried forward instead of rescored
+EvaluationReport sweepThresholds(vector<ScoredMessage> scores) {
+    EvaluationReport report;
+    sort(scores.begin(), scores.end(),
+         [](const ScoredMessage& a, const ScoredMessage& b) { return a.probability > b.probability; });
+    for (const ScoredMessage& sm : scores) (sm.isSpam ? report.spamMessages : report.hamMessages)++;
+
+    uint64_t tp = 0, fp = 0;
+    double prevTpr = 0.0, prevFpr = 0.0;
+    for (size_t i = 0; i < scores.size();) {
+        double threshold = scores[i].probability;
+        for (; i < scores.size() && scores[i].probability == threshold; ++i) (scores[i].isSpam ? tp : fp)++;
+
+        OperatingPoint point;
+        point.threshold = threshold;
+        point.truePositives = tp;
+        point.falsePositives = fp;
+        point.truePositiveRate = report.spamMessages ? (double)tp / report.spamMessages : 0.0;
+        point.falsePositiveRate = report.hamMessages ? (double)fp / report.hamMessages : 0.0;
+        point.precision = (double)tp / (tp + fp);
+        report.curve.push_back(point);
+
+        // Trapezoids handle tied scores exactly
+        report.rocAuc += (point.falsePositiveRate - prevFpr) * (point.truePositiveRate + prevTpr) / 2;
+        report.averagePrecision += (point.truePositiveRate - prevTpr) * point.precision;
+        prevTpr = point.truePositiveRate;
+        prevFpr = point.falsePositiveRate;
+    }
+    return report;
+}
+
+// Highest-recall threshold whose false-positive rate stays within target; among
+// thresholds with equal recall the highest one, which has the fewest false positives
+const OperatingPoint* thresholdForFalsePositiveRate(const EvaluationReport& report, double target) {
+    const OperatingPoint* best = nullptr;
+    for (const OperatingPoint& point : report.curve) {
+        if (point.falsePositiveRate > target) break;
+        if (!best || point.truePositiveRate > best->truePositiveRate) best = &point;
+    }
+    return best;
+}
+
+void printEvaluationReport(const EvaluationReport& report, const vector<double>& fprTargets, double currentThreshold) {
+    cout << "Messages: " << report.spamMessages << " spam, " << report.hamMessages << " ham" << endl;
+    cout << fixed << setprecision(4);
+    cout << "ROC AUC: " << report.rocAuc << "  Average precision: " << report.averagePrecision << endl;
+
+    auto printPoint = [](const string& prefix, double value, const OperatingPoint* point) {
+        ostringstream label;
+        label << prefix << defaultfloat << value;
+        cout << left << setw(22) << label.str();
+        if (!point) {
+            cout << "unreachable" << endl;
+            return;
+        }
+        cout << "threshold " << setw(8) << point->threshold << " TPR " << setw(8) << point->truePositiveRate
+             << " FPR " << setw(8) << point->falsePositiveRate << " precision " << point->precision << endl;
+    };
+
+    const OperatingPoint* current = nullptr;
+    const OperatingPoint* bestF1 = nullptr;
+    double bestF1Score = -1.0;
+    for (const OperatingPoint& point : report.curve) {
+        if (point.threshold >= currentThreshold) current = &point;
+        double f1 = 2 * point.precision * point.truePositiveRate / (point.precision + point.truePositiveRate + 1e-300);
+        if (f1 > bestF1Score) {
+            bestF1Score = f1;
+            bestF1 = &point;
+        }
+    }
+    printPoint("threshold ", currentThreshold, current);
+    printPoint("best F1 ", bestF1Score, bestF1);
+    for (double target : fprTargets) {
+        printPoint("FPR <= ", target, thresholdForFalsePositiveRate(report, target));
+    }
+    cout.unsetf(ios::fixed);
+}
+
+bool writeEvaluationCurve(const string& filename, const EvaluationReport& report) {
+    ofstream file(filename);
+    if (!file.is_open()) {
+        cerr << "Error opening file for writing: " << filename << endl;
+        return false;
+    }
+    file << setprecision(10) << "threshold,tpr,fpr,precision,recall" << endl;
+    for (const OperatingPoint& point : report.curve) {
+        file << point.threshold << "," << point.truePositiveRate << "," << point.falsePositiveRate << ","
+             << point.precision << "," << point.truePositiveRate << endl;
+    }
+    file.close();
+    return !file.fail();
+}
+
+// Print bucket distribution of a model file under every hash function
+void printHashReport(const string& filename) {
+    const HashFunction functions[] = {HASH_WYHASH, HASH_LEGACY_37};
+    cout << left << setw(12) << "hash" << setw(18) << "map"
+         << setw(10) << "entries" << setw(10) << "occupied" << setw(12) << "collisions"
+         << setw(10) << "maxChain" << setw(10) << "maxProbe" << "avgProbe" << endl;
+
+    for (HashFunction hf : functions) {
+        ChainingHashMap chainMap(10007, hf);
+        OpenAddressingHashMap openMap(10007, hf);
+        vector<string> wordsOrder;
+        loadWordFrequencies(filename, &chainMap, &openMap, wordsOrder);
+
+        const pair<const char*, HashMapStats> rows[] = {
+            {"chaining", chainMap.collectStats()},
+            {"open-addressing", openMap.collectStats()},
+        };
+        for (const auto& row : rows) {
+            const HashMapStats& st = row.second;
+            cout << left << setw(12) << hashFunctionName(hf) << setw(18) << row.first
+                 << setw(10) << st.entries << setw(10) << st.occupiedBuckets << setw(12) << st.collisions
+                 << setw(10) << st.maxChainLength << setw(10) << st.maxProbeLength
+                 << fixed << setprecision(3) << st.avgProbeLength << endl;
+            cout.unsetf(ios::fixed);
+        }
+    }
+}
+
+// Deterministic synthetic vocabulary of n distinct words with random counts
+vector<WordFreq> makeSyntheticVocabulary(size_t n) {
+    vector<WordFreq> words;
+    uint64_t state = 88172645463325252ull;
+    for (size_t i = 0; i < n; ++i) {
+        state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+        string word;
+        for (uint64_t x = state, len = 3 + state % 9; len > 0; --len, x /= 26) word += (char)('a' + x % 26);
+        words.push_back(WordFreq(word + to_string(i), (double)(state % 50), (double)((state >> 40) % 50)));
+    }
+    return words;
+}
+
+// Every word of a model file with its counts
+vector<WordFreq> loadModelWords(const string& filename) {
+    ChainingHashMap chainMap(1048573);
+    SwissHashMap swissMap;
+    vector<string> wordsOrder;
+    loadWordFrequencies(filename, &chainMap, &swissMap, wordsOrder);
+    vector<WordFreq> words;
+    chainMap.forEach([&](const WordFreq& wf) { words.push_back(wf); });
+    return words;
+}
+
+// Print the memory footprint of a vocabulary in each in-memory representation
+void printFootprintReport(const vector<WordFreq>& words) {
+    int n = words.size();
+    ChainingHashMap chainMap(max(10007, n));
+    OpenAddressingHashMap openMap(max(10007, n * 2 + 1));
+    for (const WordFreq& wf : words) {
+        chainMap.insert(wf);
+        openMap.insert(wf);
+    }
+
+    CompactWordTable compact(0), compact8(8), compact16(16);
+    compact.build(words);
+    compact8.build(words);
+    compact16.build(words);
+    TrieWordTable trie;
+    trie.build(words);
+
+    size_t count = chainMap.getCount();
+    const pair<const char*, size_t> rows[] = {
+        {"chaining", chainMap.memoryUsage()},
+        {"open-addressing", openMap.memoryUsage()},
+        {"compact", compact.memoryUsage()},
+        {"compact+score8", compact8.memoryUsage()},
+        {"compact+score16", compact16.memoryUsage()},
+        {"trie", trie.memoryUsage()},
+    };
+    cout << left << setw(18) << "representation" << right << setw(10) << "words"
+         << setw(14) << "bytes" << setw(14) << "bytes/word" << endl;
+    for (const auto& row : rows) {
+        cout << left << setw(18) << row.first << right << setw(10) << count << setw(14) << row.second
+             << setw(14) << fixed << setprecision(1) << (count ? (double)row.second / count : 0.0) << endl;
+        cout.unsetf(ios::fixed);
+    }
+}
+
+// Time hit and miss lookups on every map implementation over one vocabulary
+void runMapBenchmark(const vector<WordFreq>& words, size_t lookups) {
+    int n = max<int>(1, words.size());
+    ChainingHashMap chainMap(n);
+    OpenAddressingHashMap openMap(n * 2 + 1);
+    SwissHashMap swissMap(16);
+    CompactWordTable compact;
+    TrieWordTable trie;
+    for (const WordFreq& wf : words) {
+        chainMap.insert(wf);
+        openMap.insert(wf);
+        swissMap.insert(wf);
+    }
+    compact.build(words);
+    trie.build(words);
+
+    // Fixed pseudo-random query streams so every map sees the same keys
+    vector<string> hits, misses;
+    uint64_t state = 0x2545F4914F6CDD1Dull;
+    for (size_t i = 0; i < lookups && !words.empty(); ++i) {
+        state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+        hits.push_back(words[state % words.size()].word);
+        misses.push_back(words[(state >> 20) % words.size()].word + "#");
+    }
+
+    auto timeLookups = [](WordLookup* map, const vector<string>& keys) {
+        double sink = 0, spam, ham;
+        auto start = chrono::steady_clock::now();
+        for (const string& key : keys)
+            if (map->lookupCounts(key, spam, ham)) sink += spam;
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        volatile double keep = sink;
+        (void)keep;
+        return keys.empty() ? 0.0 : ns / keys.size();
+    };
+
+    const pair<const char*, WordLookup*> maps[] = {
+        {"chaining", &chainMap},
+        {"open-addressing", &openMap},
+        {"swiss", &swissMap},
+        {"compact", &compact},
+        {"trie", &trie},
+    };
+    cout << words.size() << " words, " << lookups << " lookups per stream" << endl;
+    cout << left << setw(18) << "map" << right << setw(12) << "hit ns" << setw(12) << "miss ns" << endl;
+    for (const auto& m : maps) {
+        timeLookups(m.second, hits); // warm up
+        double hitNs = timeLookups(m.second, hits);
+        double missNs = timeLookups(m.second, misses);
+        cout << left << setw(18) << m.first << right << fixed << setprecision(1)
+             << setw(12) << hitNs << setw(12) << missNs << endl;
+        cout.unsetf(ios::fixed);
+    }
+}
+
+// One message of a benchmark replay corpus
+struct ReplayMessage {
+    string raw;
+    bool isSpam;
+};
+
+enum MessageSizeClass { SIZE_SHORT, SIZE_MEDIUM, SIZE_HUGE, SIZE_CLASS_COUNT };
+
+const char* sizeClassName(int sizeClass) {
+    static const char* names[SIZE_CLASS_COUNT] = {"short", "medium", "huge"};
+    return names[sizeClass];
+}
+
+MessageSizeClass classifyMessageSize(size_t bytes) {
+    return bytes < (8 << 10) ? SIZE_SHORT : bytes < (512 << 10) ? SIZE_MEDIUM : SIZE_HUGE;
+}
+
+// Deterministic corpus drawn from the model's vocabulary with a Zipf-like word
+// distribution and some unknown tokens: 80% short messages (0.1-4 KiB), 19%
+// medium (8-256 KiB) and 1% huge (1-8 MiB). One message in ten is pasted text
+// opening with a "Word: ..." line, which must not be mistaken for a header.
+// The same seed always gives the same corpus, so runs of different builds are
+// comparable.
+vector<ReplayMessage> makeSyntheticCorpus(const vector<string>& vocabulary, size_t count, uint64_t seed) {
+    uint64_t state = seed | 1;
+    auto next = [&]() {
+        state ^= state << 13, state ^= state >> 7, state ^= state << 17;
+        return state;
+    };
+    auto uniform = [&]() { return (next() >> 11) * (1.0 / 9007199254740992.0); };
+
+    vector<ReplayMessage> corpus;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t pick = next() % 100;
+        size_t target = pick < 80 ? 100 + next() % 4000
+                      : pick < 99 ? (8 << 10) + next() % (248 << 10)
+                                  : (1 << 20) + next() % (7 << 20);
+        ReplayMessage message;
+        message.isSpam = next() % 2 == 0;
+        message.raw.reserve(target + 16);
+        if (next() % 10 == 0) message.raw += i % 2 ? "Note: " : "Subject: ";
+        while (message.raw.size() < target) {
+            if (vocabulary.empty() || next() % 10 == 0) {
+                message.raw += "zq" + to_string(next() % 100000);
+            } else {
+                // Rank ~ N^u gives a heavy head of common words and a long tail
+                size_t rank = (size_t)pow((double)vocabulary.size(), uniform()) - 1;
+                message.raw += vocabulary[min(rank, vocabulary.size() - 1)];
+            }
+            message.raw += next() % 12 == 0 ? '\n' : ' ';
+        }
+        corpus.push_back(move(message));
+    }
+    return corpus;
+}
+
+// Save a corpus as <prefix>.spam.mbox and <prefix>.ham.mbox for later replay
+bool writeCorpusAsMbox(const string& prefix, const vector<ReplayMessage>& corpus) {
+    ofstream spamFile(prefix + ".spam.mbox", ios::binary), hamFile(prefix + ".ham.mbox", ios::binary);
+    if (!spamFile.is_open() || !hamFile.is_open()) {
+        cerr << "Error opening file for writing: " << prefix << ".{spam,ham}.mbox" << endl;
+        return false;
+    }
+    for (const ReplayMessage& message : corpus) {
+        ofstream& file = message.isSpam ? spamFile : hamFile;
+        file << "From bench@localhost Thu Jan  1 00:00:00 1970\n";
+        istringstream lines(message.raw);
+        string line;
+        while (getline(lines, line)) {
+            size_t quotes = line.find_first_not_of('>');
+            if (quotes != string::npos && line.compare(quotes, 5, "From ") == 0) file << '>';
+            file << line << '\n';
+        }
+        file << '\n';
+    }
+    return !spamFile.fail() && !hamFile.fail();
+}
+
+// Stages of the classify path timed by the end-to-end benchmark
+enum BenchStage { STAGE_PREPROCESS, STAGE_TOKENIZE, STAGE_LOOKUP, STAGE_SCORE, STAGE_HIGHLIGHT, STAGE_FEEDBACK,
+                  STAGE_TOTAL, STAGE_COUNT };
+
+const char* benchStageName(int stage) {
+    static const char* names[STAGE_COUNT] = {"preprocess", "tokenize", "lookup", "score", "highlight", "feedback", "total"};
+    return names[stage];
+}
+
+// Exact latency distribution of one stage, in nanoseconds
+struct StageLatency {
+    vector<double> samples;
+
+    double quantile(double q) const {
+        if (samples.empty()) return 0.0;
+        return samples[min(samples.size() - 1, (size_t)(q * samples.size()))];
+    }
+    double mean() const {
+        double sum = 0;
+        for (double ns : samples) sum += ns;
+        return samples.empty() ? 0.0 : sum / samples.size();
+    }
+};
+
+struct BenchOptions {
+    bool highlight = false;
+    bool feedback = false;
+    int iterations = 1;
+    double threshold = 0.7;
+};
+
+struct BenchResult {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t sampledMessages = 0;
+    uint64_t textlessMessages = 0; // preprocessing left no text: a sign of misparsed input
+    double seconds = 0.0;
+    StageLatency stages[STAGE_COUNT];
+    StageLatency bySize[SIZE_CLASS_COUNT];
+};
+
+// Replay a corpus through the same classify path as the GUI: MIME preprocessing,
+// budgeted tokenization, lookup and scoring, then optionally highlight span
+// computation and feedback into the model. One untimed pass warms caches first.
+BenchResult runEndToEndBenchmark(AppData* app, const vector<ReplayMessage>& corpus, const BenchOptions& options) {
+    BenchResult result;
+    auto classifyOnce = [&](const ReplayMessage& message, bool record) {
+        double stageNs[STAGE_COUNT] = {};
+        auto lap = chrono::steady_clock::now();
+        auto split = [&](int stage) {
+            auto now = chrono::steady_clock::now();
+            stageNs[stage] = chrono::duration<double, nano>(now - lap).count();
+            lap = now;
+        };
+
+        shared_ptr<SpamModel> model = currentModel(app);
+        string text = extractMessageText(message.raw);
+        split(STAGE_PREPROCESS);
+        bool sampled = false;
+        app->currentEmailWords = tokenizeWithinBudget(text.data(), text.size(), app->messageBudget, sampled);
+        split(STAGE_TOKENIZE);
+        EmailClassifier classifier(&model->chainMap, options.threshold, app->messageBudget.maxTokens);
+        vector<double> probabilities = classifier.lookupWords(app->currentEmailWords);
+        split(STAGE_LOOKUP);
+        volatile double probability = classifier.scoreLookups(probabilities).second;
+        (void)probability;
+        split(STAGE_SCORE);
+        if (options.highlight) {
+            volatile size_t spans = computeHighlightSpans(text.data(), text.size(), &model->chainMap, app->messageBudget).size();
+            (void)spans;
+        }
+        split(STAGE_HIGHLIGHT);
+        if (options.feedback && record) applyFeedbackToModel(app, message.isSpam);
+        split(STAGE_FEEDBACK);
+        if (!record) return;
+
+        double totalNs = 0;
+        for (int stage = 0; stage < STAGE_TOTAL; ++stage) {
+            totalNs += stageNs[stage];
+            result.stages[stage].samples.push_back(stageNs[stage]);
+        }
+        result.stages[STAGE_TOTAL].samples.push_back(totalNs);
+        result.bySize[classifyMessageSize(message.raw.size())].samples.push_back(totalNs);
+        result.messages++;
+        result.bytes += message.raw.size();
+        result.sampledMessages += sampled;
+        result.textlessMessages += text.find_first_not_of(" \t\r\n") == string::npos;
+    };
+
+    for (const ReplayMessage& message : corpus) classifyOnce(message, false);
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < options.iterations; ++i)
+        for (const ReplayMessage& message : corpus) classifyOnce(message, true);
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for (StageLatency& stage : result.stages) sort(stage.samples.begin(), stage.samples.end());
+    for (StageLatency& size : result.bySize) sort(size.samples.begin(), size.samples.end());
+    return result;
+}
+
+void printBenchResult(const BenchResult& result, const BenchOptions& options) {
+    cout << result.messages << " messages, " << fixed << setprecision(1) << result.bytes / 1048576.0 << " MiB in "
+         << setprecision(3) << result.seconds << " s: " << setprecision(1) << result.messages / result.seconds
+         << " msg/s, " << result.bytes / 1048576.0 / result.seconds << " MiB/s (" << result.sampledMessages
+         << " sampled)" << endl;
+    if (result.textlessMessages > 0)
+        cout << "Warning: " << result.textlessMessages << " messages had no text after preprocessing" << endl;
+
+    cout << left << setw(12) << "stage" << right << setw(10) << "count" << setw(12) << "mean us" << setw(12)
+         << "p50 us" << setw(12) << "p99 us" << setw(12) << "p99.9 us" << setw(12) << "max us" << endl;
+    auto printRow = [](const string& name, const StageLatency& latency) {
+        cout << left << setw(12) << name << right << setw(10) << latency.samples.size() << setprecision(1)
+             << setw(12) << latency.mean() / 1000 << setw(12) << latency.quantile(0.5) / 1000 << setw(12)
+             << latency.quantile(0.99) / 1000 << setw(12) << latency.quantile(0.999) / 1000 << setw(12)
+             << latency.quantile(1.0) / 1000 << endl;
+    };
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        if ((stage == STAGE_HIGHLIGHT && !options.highlight) || (stage == STAGE_FEEDBACK && !options.feedback)) continue;
+        printRow(benchStageName(stage), result.stages[stage]);
+    }
+    for (int size = 0; size < SIZE_CLASS_COUNT; ++size) {
+        if (!result.bySize[size].samples.empty()) printRow(string("total/") + sizeClassName(size), result.bySize[size]);
+    }
+    cout.unsetf(ios::fixed);
+}
+
+// Machine-readable results, one object per run, for comparing builds
+bool writeBenchJson(const string& filename, const BenchResult& result, const BenchOptions& options) {
+    ofstream file(filename);
+    if (!file.is_open()) {
+        cerr << "Error opening file for writing: " << filename << endl;
+        return false;
+    }
+    auto writeLatency = [&](const StageLatency& latency) {
+        file << "{\"count\": " << latency.samples.size() << ", \"mean_us\": " << latency.mean() / 1000
+             << ", \"p50_us\": " << latency.quantile(0.5) / 1000 << ", \"p99_us\": " << latency.quantile(0.99) / 1000
+             << ", \"p999_us\": " << latency.quantile(0.999) / 1000 << ", \"max_us\": " << latency.quantile(1.0) / 1000
+             << "}";
+    };
+    file << setprecision(6) << "{\n"
+         << "  \"messages\": " << result.messages << ",\n"
+         << "  \"bytes\": " << result.bytes << ",\n"
+         << "  \"sampled_messages\": " << result.sampledMessages << ",\n"
+         << "  \"textless_messages\": " << result.textlessMessages << ",\n"
+         << "  \"iterations\": " << options.iterations << ",\n"
+         << "  \"seconds\": " << result.seconds << ",\n"
+         << "  \"messages_per_second\": " << result.messages / result.seconds << ",\n"
+         << "  \"mib_per_second\": " << result.bytes / 1048576.0 / result.seconds << ",\n"
+         << "  \"stages\": {";
+    bool first = true;
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+        if ((stage == STAGE_HIGHLIGHT && !options.highlight) || (stage == STAGE_FEEDBACK && !options.feedback)) continue;
+        file << (first ? "\n" : ",\n") << "    \"" << benchStageName(stage) << "\": ";
+        writeLatency(result.stages[stage]);
+        first = false;
+    }
+    file << "\n  },\n  \"sizes\": {";
+    first = true;
+    for (int size = 0; size < SIZE_CLASS_COUNT; ++size) {
+        file << (first ? "\n" : ",\n") << "    \"" << sizeClassName(size) << "\": ";
+        writeLatency(result.bySize[size]);
+        first = false;
+    }
+    file << "\n  }\n}\n";
+    file.close();
+    return !file.fail();
+}
+
+// Write a model back in the format it was loaded from
+bool saveModelFile(const string& filename, SpamModel& model, bool binary) {
+    return writeModelFile(filename, snapshotWords(model), binary);
+}
+
+// Run a command-line tool instead of the GUI; returns -1 when argv names no tool
+int runCommandLineTool(int argc, char* argv[]) {
+    if (argc < 2) return -1;
+    string command = argv[1];
+
+    if (command == "--hash-report") {
+        if (argc < 3) {
+            cerr << "Usage: " << argv[0] << " --hash-report <model.csv>" << endl;
+            return 1;
+        }
+        printHashReport(argv[2]);
+        return 0;
+    }
+
+    if (command == "--footprint") {
+        string modelFile;
+        size_t syntheticWords = 0;
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--synthetic" && i + 1 < argc) syntheticWords = atol(argv[++i]);
+            else modelFile = arg;
+        }
+        if (modelFile.empty() == (syntheticWords == 0)) {
+            cerr << "Usage: " << argv[0] << " --footprint <model> | --synthetic <words>" << endl;
+            return 1;
+        }
+        printFootprintReport(modelFile.empty() ? makeSyntheticVocabulary(syntheticWords) : loadModelWords(modelFile));
+        return 0;
+    }
+
+    if (command == "--bench-maps") {
+        string modelFile;
+        size_t syntheticWords = 0, lookups = 1000000;
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--synthetic" && i + 1 < argc) syntheticWords = atol(argv[++i]);
+            else if (arg == "--lookups" && i + 1 < argc) lookups = atol(argv[++i]);
+            else modelFile = arg;
+        }
+        if (modelFile.empty() && syntheticWords == 0) {
+            cerr << "Usage: " << argv[0] << " --bench-maps <model> | --synthetic <words> [--lookups N]" << endl;
+            return 1;
+        }
+
+        vector<WordFreq> words;
+        if (!modelFile.empty()) words = loadModelWords(modelFile);
+        vector<WordFreq> synthetic = makeSyntheticVocabulary(syntheticWords);
+        words.insert(words.end(), synthetic.begin(), synthetic.end());
+        runMapBenchmark(words, lookups);
+        return 0;
+    }
+
+    if (command == "--relabel") {
+        if (argc < 4 || (string(argv[2]) != "spam" && string(argv[2]) != "ham")) {
+            cerr << "Usage: " << argv[0] << " --relabel spam|ham <path>... [--model <model>] [--user <name>]" << endl;
+            return 1;
+        }
+        bool isSpam = string(argv[2]) == "spam";
+        string modelFile = MODEL_FILE, user;
+        vector<CorpusSource> sources;
+        for (int i = 3; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--model" && i + 1 < argc) modelFile = argv[++i];
+            else if (arg == "--user" && i + 1 < argc) user = argv[++i];
+            else sources.push_back({arg, isSpam});
+        }
+
+        AppData app{};
+        app.model = loadSpamModel(modelFile);
+        if (!app.model) return 1;
+        app.messageBudget = MessageBudget::fromEnvironment();
+        string featureFile = modelFile + ".features";
+        if (!app.featureScorer.load(featureFile)) app.featureScorer.seedFromModel(app.model->chainMap);
+
+        // Every message goes into one batch: one model update per distinct token, one save
+        FeedbackBatch batch(app.featureScorer);
+        for (const CorpusWorkItem& item : enumerateCorpus(sources)) {
+            forEachCorpusMessage(item, [&](const string& message) {
+                string text = extractMessageText(message);
+                bool sampled;
+                batch.add(tokenizeWithinBudget(text.data(), text.size(), app.messageBudget, sampled), isSpam);
+            });
+        }
+        if (!user.empty()) {
+            // Personal feedback changes the user's delta next to the model, not the
+            // shared words; the n-gram table has no per-user layer and learns as usual
+            string deltaFile = userDeltaFile(modelFile, user);
+            UserDelta delta;
+            if (!delta.load(deltaFile)) return 1;
+            delta.apply(batch, &app.model->chainMap, app.budget);
+            uint64_t featureUpdates = batch.applyFeatureDeltas(app.featureScorer);
+            if (!delta.save(deltaFile) || !app.featureScorer.save(featureFile)) return 1;
+            cout << "Relabeled " << batch.messageCount() << " messages as " << argv[2] << " for " << user << ": "
+                 << delta.map()->getCount() << " words, " << delta.memoryUsage() << " bytes, " << featureUpdates
+                 << " n-gram updates, saved " << deltaFile << " and " << featureFile << endl;
+            return 0;
+        }
+
+        size_t wordsBefore = app.model->wordsOrder.size();
+        applyFeedbackBatch(&app, batch);
+        if (app.model->wordsOrder.size() < wordsBefore) {
+            cerr << "Refusing to save " << modelFile << ": it would lose words it was loaded with" << endl;
+            return 1;
+        }
+        if (!saveModelFile(modelFile, *app.model, isBinaryModelFile(modelFile)) || !app.featureScorer.save(featureFile))
+            return 1;
+        cout << "Relabeled " << batch.messageCount() << " messages as " << argv[2] << ": " << batch.distinctWords()
+             << " distinct tokens, " << (long)app.model->wordsOrder.size() - (long)wordsBefore
+             << " net new words, saved " << modelFile << endl;
+        return 0;
+    }
+
+    if (command == "--bench") {
+        vector<CorpusSource> sources;
+        string modelFile, jsonFile, corpusPrefix;
+        size_t syntheticCount = 500;
+        uint64_t seed = 42;
+        BenchOptions options;
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if ((arg == "--spam" || arg == "--ham") && i + 1 < argc) sources.push_back({argv[++i], arg == "--spam"});
+            else if (arg == "--model" && i + 1 < argc) modelFile = argv[++i];
+            else if (arg == "--synthetic" && i + 1 < argc) syntheticCount = atol(argv[++i]);
+            else if (arg == "--seed" && i + 1 < argc) seed = strtoull(argv[++i], nullptr, 10);
+            else if (arg == "--iterations" && i + 1 < argc) options.iterations = max(1, atoi(argv[++i]));
+            else if (arg == "--highlight") options.highlight = true;
+            else if (arg == "--feedback") options.feedback = true;
+            else if (arg == "--json" && i + 1 < argc) jsonFile = argv[++i];
+            else if (arg == "--write-corpus" && i + 1 < argc) corpusPrefix = argv[++i];
+            else {
+                cerr << "Unknown argument: " << arg << endl;
+                return 1;
+            }
+        }
+        if (modelFile.empty()) {
+            cerr << "Usage: " << argv[0] << " --bench --model <model> [--spam/--ham <path> ... | --synthetic N [--seed S]]"
+                 << " [--iterations R] [--highlight] [--feedback] [--json out.json] [--write-corpus prefix]" << endl;
+            return 1;
+        }
+
+        AppData app{};
+        app.model = loadSpamModel(modelFile);
+        if (!app.model) return 1;
+        app.messageBudget = MessageBudget::fromEnvironment();
+
+        vector<ReplayMessage> corpus;
+        if (!sources.empty()) {
+            for (const CorpusWorkItem& item : enumerateCorpus(sources)) {
+                forEachCorpusMessage(item, [&](const string& message) { corpus.push_back({message, item.isSpam}); });
+            }
+        } else {
+            corpus = makeSyntheticCorpus(app.model->wordsOrder, syntheticCount, seed);
+        }
+        // Rates over zero messages would be NaN, and invalid in the JSON output
+        if (corpus.empty()) {
+            cerr << "No messages to benchmark: the --spam/--ham paths hold no messages or --synthetic is 0" << endl;
+            return 1;
+        }
+        if (!corpusPrefix.empty() && !writeCorpusAsMbox(corpusPrefix, corpus)) return 1;
+
+        BenchResult result = runEndToEndBenchmark(&app, corpus, options);
+        printBenchResult(result, options);
+        if (!jsonFile.empty() && !writeBenchJson(jsonFile, result, options)) return 1;
+        return 0;
+    }
+
+    if (command == "--evaluate") {
+        vector<CorpusSource> sources;
+        string modelFile, curveFile;
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        unsigned folds = 0;
+        double threshold = 0.7;
+        vector<double> fprTargets = {0.001, 0.01, 0.05};
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if ((arg == "--spam" || arg == "--ham") && i + 1 < argc) sources.push_back({argv[++i], arg == "--spam"});
+            else if (arg == "--model" && i + 1 < argc) modelFile = argv[++i];
+            else if (arg == "--folds" && i + 1 < argc) folds = max(0, atoi(argv[++i]));
+            else if (arg == "--threads" && i + 1 < argc) threads = max(1, atoi(argv[++i]));
+            else if (arg == "--threshold" && i + 1 < argc) threshold = atof(argv[++i]);
+            else if (arg == "--curve" && i + 1 < argc) curveFile = argv[++i];
+            else if (arg == "--fpr" && i + 1 < argc) {
+                fprTargets.clear();
+                for (const string& target : splitCSVLine(argv[++i])) fprTargets.push_back(atof(target.c_str()));
+            } else {
+                cerr << "Unknown argument: " << arg << endl;
+                return 1;
+            }
+        }
+        if (sources.empty() || modelFile.empty() == (folds < 2)) {
+            cerr << "Usage: " << argv[0] << " --evaluate --spam <path> --ham <path> [--spam/--ham ...]"
+                 << " (--model <model> | --folds K) [--threads N] [--threshold T] [--fpr a,b,...] [--curve out.csv]"
+                 << endl;
+            return 1;
+        }
+
+        auto start = chrono::steady_clock::now();
+        vector<ScoredMessage> scores;
+        if (!modelFile.empty()) {
+            // The model is only read here, so it is served from the compact table
+            CompactWordTable table;
+            table.build(loadModelWords(modelFile));
+            scores = scoreCorpus(sources, threads, [&](const string&) -> WordLookup* { return &table; });
+        } else {
+            // One counting pass keeps totals and per-fold counts; each fold's model is the
+            // totals minus its own counts
+            uint64_t messages = 0, bytes = 0;
+            vector<WordFreq> counts = trainFromCorpus(sources, threads, messages, bytes, folds);
+            SwissHashMap countMap;
+            for (const WordFreq& wf : counts) countMap.insert(wf);
+            vector<WordFreq>().swap(counts);
+            vector<FoldView> views;
+            for (unsigned f = 0; f < folds; ++f) views.emplace_back(&countMap, f);
+            scores = scoreCorpus(sources, threads,
+                                 [&](const string& message) -> WordLookup* { return &views[messageFold(message, folds)]; });
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        EvaluationReport report = sweepThresholds(move(scores));
+        cout << "Scored " << report.spamMessages + report.hamMessages << " messages in " << seconds << " s"
+             << (folds ? " (" + to_string(folds) + "-fold cross-validation)" : "") << endl;
+        printEvaluationReport(report, fprTargets, threshold);
+        if (!curveFile.empty() && !writeEvaluationCurve(curveFile, report)) return 1;
+        return 0;
+    }
+
+    if (command == "--train") {
+        vector<CorpusSource> sources;
+        string outFile;
+        bool binary = false;
+        unsigned threads = max(1u, thread::hardware_concurrency());
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if ((arg == "--spam" || arg == "--ham") && i + 1 < argc) sources.push_back({argv[++i], arg == "--spam"});
+            else if (arg == "--out" && i + 1 < argc) outFile = argv[++i];
+            else if (arg == "--threads" && i + 1 < argc) threads = max(1, atoi(argv[++i]));
+            else if (arg == "--binary") binary = true;
+            else {
+                cerr << "Unknown argument: " << arg << endl;
+                return 1;
+            }
+        }
+        if (sources.empty() || outFile.empty()) {
+            cerr << "Usage: " << argv[0] << " --train --spam <path> --ham <path> [--spam/--ham ...]"
+                 << " --out <model> [--threads N] [--binary]" << endl;
+            return 1;
+        }
+
+        auto start = chrono::steady_clock::now();
+        uint64_t messages = 0, bytes = 0;
+        vector<WordFreq> words = trainFromCorpus(sources, threads, messages, bytes);
+        bool ok = binary ? writeWordFrequenciesToBinary(outFile, words)
+                         : writeWordFrequenciesToTransposedCSV(outFile, words);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "Trained on " << messages << " messages (" << bytes / (1024.0 * 1024.0) << " MB) with "
+             << threads << " threads in " << seconds << " s: " << words.size() << " words -> " << outFile << endl;
+        return ok ? 0 : 1;
+    }
+
+    if (command == "--merge") {
+        vector<ModelShard> shards;
+        string outFile;
+        double halfLifeDays = 0.0;
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--out" && i + 1 < argc) outFile = argv[++i];
+            else if (arg == "--half-life-days" && i + 1 < argc) halfLifeDays = atof(argv[++i]);
+            else {
+                // shard.csv or shard.csv:weight
+                ModelShard shard;
+                shard.path = arg;
+                size_t colon = arg.rfind(':');
+                if (colon != string::npos) {
+                    char* end = nullptr;
+                    double weight = strtod(arg.c_str() + colon + 1, &end);
+                    if (end && *end == '\0' && colon + 1 < arg.size()) {
+                        shard.path = arg.substr(0, colon);
+                        shard.weight = weight;
+                    }
+                }
+                shards.push_back(shard);
+            }
+        }
+        if (shards.empty() || outFile.empty()) {
+            cerr << "Usage: " << argv[0] << " --merge --out <model.csv> [--half-life-days D]"
+                 << " <shard.csv>[:weight] ..." << endl;
+            return 1;
+        }
+        return mergeModelShards(shards, outFile, halfLifeDays) ? 0 : 1;
+    }
+    return -1;
+}
+
 // Main function
 int main(int argc, char* argv[]) {
+    int toolStatus = runCommandLineTool(argc, argv);
+    if (toolStatus >= 0) return toolStatus;
+
     gtk_init(&argc, &argv);
 
     // Apply CSS styling
@@ -1057,6 +5317,10 @@ int main(int argc, char* argv[]) {
     gtk_widget_set_name(app.viewDatasetButton, "view-dataset-button");
     gtk_widget_set_tooltip_text(app.viewDatasetButton, "View word frequencies in the dataset");
 
+    app.metricsButton = gtk_button_new_with_label("Metrics");
+    gtk_widget_set_name(app.metricsButton, "metrics-button");
+    gtk_widget_set_tooltip_text(app.metricsButton, "View latency histograms and hash map counters");
+
     app.resultLabel = gtk_label_new("");
     gtk_widget_set_name(app.resultLabel, "result-label");
     gtk_widget_set_tooltip_text(app.resultLabel, "Shows classification result");
@@ -1072,7 +5336,15 @@ int main(int argc, char* argv[]) {
     gtk_widget_set_sensitive(app.markSpamButton, FALSE);
     gtk_widget_set_sensitive(app.markHamButton, FALSE);
 
+    app.userEntry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(app.userEntry), "shared model");
+    gtk_widget_set_tooltip_text(app.userEntry, "Classify and train with this user's personal model");
+
     GtkWidget* box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 10);
+    GtkWidget* userBox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    gtk_box_pack_start(GTK_BOX(userBox), gtk_label_new("User:"), FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(userBox), app.userEntry, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(box), userBox, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(box), app.textView, TRUE, TRUE, 0);
 
     GtkWidget* buttonBox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
@@ -1080,6 +5352,7 @@ int main(int argc, char* argv[]) {
     gtk_box_pack_start(GTK_BOX(buttonBox), app.clearButton, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(buttonBox), app.loadButton, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(buttonBox), app.viewDatasetButton, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(buttonBox), app.metricsButton, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(box), buttonBox, FALSE, FALSE, 0);
 
     gtk_box_pack_start(GTK_BOX(box), app.resultLabel, FALSE, FALSE, 0);
@@ -1100,14 +5373,60 @@ int main(int argc, char* argv[]) {
         gtk_text_buffer_create_tag(buffer, tagName.c_str(), "foreground", get_ham_color(i), NULL);
     }
 
-    // Load word frequencies once at startup
-    loadWordFrequenciesFromTransposedCSV("/home/ka0s_5131/Desktop/Dsa_project/final.csv", &app.chainMap, &app.openMap, app.wordsOrder);
+    // Optional periodic Prometheus dump, e.g. for node_exporter's textfile collector
+    const char* metricsFile = getenv("SPAM_METRICS_FILE");
+    if (metricsFile && *metricsFile) {
+        const char* intervalEnv = getenv("SPAM_METRICS_INTERVAL");
+        int interval = intervalEnv ? atoi(intervalEnv) : 15;
+        g_timeout_add_seconds(interval > 0 ? interval : 15, on_metrics_dump_timeout, new string(metricsFile));
+    }
+
+    // Optional limit on how far feedback may grow the vocabulary
+    const char* maxWordsEnv = getenv("SPAM_MAX_WORDS");
+    if (maxWordsEnv && atol(maxWordsEnv) > 0) {
+        app.budget.maxWords = (size_t)atol(maxWordsEnv);
+    }
+    const char* maxUserWordsEnv = getenv("SPAM_MAX_USER_WORDS");
+    if (maxUserWordsEnv && atol(maxUserWordsEnv) > 0) app.budget.maxUserWords = (size_t)atol(maxUserWordsEnv);
+
+    // Load word frequencies at startup, then follow changes to the file
+    FileStamp loadedStamp;
+    app.model = loadSpamModel(MODEL_FILE, &loadedStamp);
+    if (!app.model) {
+        // A file that is there but failed validation is never overwritten;
+        // feedback resumes once a valid version has been loaded
+        app.modelSaveBlocked = statFile(MODEL_FILE).valid;
+        cerr << (app.modelSaveBlocked ? "Model file rejected; starting with an empty model and feedback disabled"
+                                      : "Starting with an empty model")
+             << endl;
+        app.model = make_shared<SpamModel>();
+    }
+    ModelReloader reloader(&app, MODEL_FILE);
+    app.reloader = &reloader;
+    reloader.start(loadedStamp);
+    // The file may have been caught mid-deploy: try again once it settles
+    if (app.modelSaveBlocked) reloader.requestReload(true);
+    g_unix_signal_add(SIGHUP, on_reload_signal, &reloader);
+
+    // Saves run in the background; declared after the reloader so queued
+    // saves finish, and report to it, before it stops
+    SnapshotWriter snapshotWriter;
+    app.snapshotWriter = &snapshotWriter;
+
+    // Per-message work limit for classification
+    app.messageBudget = MessageBudget::fromEnvironment();
+
+    // Hashed n-gram counters persist next to the model; seed them from it on first run
+    if (!app.featureScorer.load(FEATURE_TABLE_FILE)) {
+        app.featureScorer.seedFromModel(app.model->chainMap);
+    }
 
     // Connect signals
     g_signal_connect(app.classifyButton, "clicked", G_CALLBACK(on_classify_button_clicked), &app);
     g_signal_connect(app.clearButton, "clicked", G_CALLBACK(on_clear_button_clicked), &app);
     g_signal_connect(app.loadButton, "clicked", G_CALLBACK(on_load_button_clicked), &app);
     g_signal_connect(app.viewDatasetButton, "clicked", G_CALLBACK(on_view_dataset_button_clicked), &app);
+    g_signal_connect(app.metricsButton, "clicked", G_CALLBACK(on_metrics_button_clicked), &app);
     g_signal_connect(app.markSpamButton, "clicked", G_CALLBACK(on_mark_spam_button_clicked), &app);
     g_signal_connect(app.markHamButton, "clicked", G_CALLBACK(on_mark_ham_button_clicked), &app);
     g_signal_connect(app.window, "destroy", G_CALLBACK(gtk_main_quit), NULL);